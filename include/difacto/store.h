@@ -7,6 +7,8 @@
 #include <vector>
 #include <string>
 #include <atomic>
+#include <limits>
+#include <utility>
 #include "./base.h"
 #include "dmlc/io.h"
 #include "dmlc/parameter.h"
@@ -33,6 +35,10 @@ class Store {
   static const int kFeaCount = 1;
   static const int kWeight = 2;
   static const int kGradient = 3;
+  /** \brief gradients of only the rows in a row mask, see \ref FieldDims::PackRows */
+  static const int kGradientRows = 4;
+  /** \brief kGradientRows with each row quantized, see \ref GradCompressor */
+  static const int kGradientCodes = 5;
   /**
    * \brief init
    *
@@ -74,6 +80,25 @@ class Store {
                    SArray<int>* lens,
                    const std::function<void()>& on_complete = nullptr) = 0;
 
+  /**
+   * \brief pull only the rows in the row masks of the features, see \ref
+   * Updater::GetRows
+   *
+   * @param fea_ids
+   * @param val_type
+   * @param masks the row masks, the same number of slots for each feature
+   * @param vals the rows in the masks, packed for each feature
+   * @param lens
+   * @param on_complete
+   *
+   * @return timestamp
+   */
+  virtual int PullRows(const SArray<feaid_t>& fea_ids,
+                       int val_type,
+                       const SArray<real_t>& masks,
+                       SArray<real_t>* vals,
+                       SArray<int>* lens,
+                       const std::function<void()>& on_complete = nullptr) = 0;
 
   /**
    * \brief wait until a push or a pull is actually finished
@@ -94,6 +119,17 @@ class Store {
    * \brief return the rank of this node
    */
   virtual int Rank() = 0;
+  /**
+   * \brief return the key range [begin, end) of this server node, which is all
+   * keys if there is a single server
+   */
+  virtual std::pair<feaid_t, feaid_t> KeyRange() {
+    return {0, std::numeric_limits<feaid_t>::max()};
+  }
+  /**
+   * \brief whether this node was restarted to replace a dead one
+   */
+  virtual bool IsRecovery() { return false; }
   /**
    * \brief set an updater for the store, only required for a server node
    */
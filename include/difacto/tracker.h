@@ -83,8 +83,12 @@ class Tracker {
   virtual void IssueAndWait(int node_id, std::string args) = 0;
   /**
    * \brief start dispath workload
+   *
+   * \param skip the parts which are already finished, such as by a run that
+   * was restarted
    */
-  virtual void StartDispatch(int num_jobs_per_epoch, int job_type, int epoch) = 0;
+  virtual void StartDispatch(int num_parts, int job_type, int epoch,
+                             const std::vector<int>& skip) = 0;
   /**
    * \brief return the number of unfinished job
    */
@@ -64,6 +64,19 @@ class Updater {
                    int data_type,
                    SArray<real_t>* data,
                    SArray<int>* data_offset) = 0;
+  /**
+   * \brief get only some rows of the weights on the given features
+   *
+   * @param fea_ids the list of feature ids
+   * @param masks the row masks of the features, a bit for each row
+   * @param model the rows in the masks, packed for each feature
+   * @param model_offset could be empty
+   */
+  virtual void GetRows(const SArray<feaid_t>& fea_ids,
+                       int data_type,
+                       const SArray<real_t>& masks,
+                       SArray<real_t>* data,
+                       SArray<int>* data_offset) = 0;
   /**
    * \brief update the model given a list of key-value pairs
    *
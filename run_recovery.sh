@@ -0,0 +1,48 @@
+#!/bin/bash
+# kill a server in the middle of an epoch, and check that it is restarted,
+# recovers from its last checkpoint and update log, and the job ends with a
+# model as good as the one of a run without failure
+#
+# usage: ./run_recovery.sh [config_file] [key=val ...]
+conf=${1:-local.conf}
+shift
+# the requests to the dead server are resent, and the scheduler finds it dead
+# by its heartbeats
+export PS_RESEND=1
+export PS_HEARTBEAT_INTERVAL=1
+export PS_HEARTBEAT_TIMEOUT=10
+submit="python dmlc-core/tracker/dmlc-submit --cluster local --num-workers 2 --num-servers 2 --local-num-attempt 1"
+args="update_log=1 checkpoint_batches=1000 model_format=snapshot max_num_epochs=3 $*"
+tol=0.01
+
+# the last validation AUC in a log
+auc() { grep "Validation" $1 | tail -1 | sed 's/.*AUC = //'; }
+
+rm -f rec_ref_model* rec_model*
+$submit build/difacto $conf $args model_out=./rec_ref_model > rec_ref.log 2>&1 || {
+  echo "the run without failure failed, see rec_ref.log"; exit 1; }
+
+$submit build/difacto $conf $args model_out=./rec_model > rec.log 2>&1 &
+job=$!
+# wait for the first checkpoint and its log, then kill a server
+while [ ! -e rec_model_part-0 ] || ! ls rec_model_part-0.log-* > /dev/null 2>&1; do
+  kill -0 $job 2> /dev/null || { echo "the job ended before a checkpoint"; exit 1; }
+  sleep 1
+done
+sleep 5
+for pid in $(pgrep -f "build/difacto"); do
+  if tr '\0' '\n' < /proc/$pid/environ 2> /dev/null | grep -q "^DMLC_ROLE=server"; then
+    echo "kill server $pid"
+    kill -9 $pid
+    break
+  fi
+done
+wait $job || { echo "the job failed after killing a server, see rec.log"; exit 1; }
+
+grep -q "replayed" rec.log || { echo "no server recovered, see rec.log"; exit 1; }
+ref=$(auc rec_ref.log)
+got=$(auc rec.log)
+echo "validation AUC: $got, without failure: $ref"
+awk -v a=$got -v b=$ref -v t=$tol 'BEGIN { d = a - b; if (d < 0) d = -d; exit d > t }' || {
+  echo "the recovered model differs by more than $tol"; exit 1; }
+echo "recovered"
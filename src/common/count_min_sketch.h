@@ -0,0 +1,76 @@
+/**
+ *  Copyright (c) 2016 by Contributors
+ */
+#ifndef DIFACTO_COMMON_COUNT_MIN_SKETCH_H_
+#define DIFACTO_COMMON_COUNT_MIN_SKETCH_H_
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+#include "./hash.h"
+namespace difacto {
+/**
+ * \brief a count-min sketch, which estimates the count of a key by the
+ * minimal of depth counters with a fixed memory
+ *
+ * the estimation never underestimates the true count. conservative update is
+ * used to reduce the overestimation, namely only the minimal counters are
+ * increased.
+ */
+class CountMinSketch {
+ public:
+  CountMinSketch() { }
+  ~CountMinSketch() { }
+  /**
+   * \brief allocate the sketch
+   *
+   * @param width the number of counters in a row
+   * @param depth the number of rows, each row has its own hash function
+   */
+  void Init(size_t width, int depth) {
+    CHECK_GT(width, 0U); CHECK_GT(depth, 0);
+    width_ = width; depth_ = depth;
+    data_.assign(width_ * depth_, 0);
+  }
+  /** \brief whether Init is called */
+  bool empty() const { return data_.empty(); }
+  /**
+   * \brief add cnt to a key
+   * @return the estimated count after adding
+   */
+  real_t Add(feaid_t key, real_t cnt) {
+    real_t est = Query(key) + cnt;
+    for (int i = 0; i < depth_; ++i) {
+      real_t& c = data_[Pos(key, i)];
+      if (c < est) c = est;
+    }
+    return est;
+  }
+  /** \brief return the estimated count of a key */
+  real_t Query(feaid_t key) const {
+    real_t est = std::numeric_limits<real_t>::max();
+    for (int i = 0; i < depth_; ++i) {
+      est = std::min(est, data_[Pos(key, i)]);
+    }
+    return est;
+  }
+  /** \brief multiply all counters by factor, so that old counts fade out */
+  void Decay(real_t factor) {
+    for (real_t& c : data_) c *= factor;
+  }
+  /** \brief the memory used in bytes */
+  size_t MemSize() const { return data_.size() * sizeof(real_t); }
+
+ private:
+  inline size_t Pos(feaid_t key, int row) const {
+    // splitmix64 seeded by the row
+    uint64_t x = SplitMix64(key + 0x9E3779B97F4A7C15ULL * row);
+    return row * width_ + x % width_;
+  }
+  size_t width_ = 0;
+  int depth_ = 0;
+  std::vector<real_t> data_;
+};
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_COUNT_MIN_SKETCH_H_
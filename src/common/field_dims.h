@@ -0,0 +1,128 @@
+/**
+ *  Copyright (c) 2016 by Contributors
+ * @file   field_dims.h
+ * @brief  the layout of the field rows of V
+ */
+#ifndef DIFACTO_COMMON_FIELD_DIMS_H_
+#define DIFACTO_COMMON_FIELD_DIMS_H_
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+namespace difacto {
+
+/**
+ * \brief the dimensions of the field rows of V
+ *
+ * V of a feature has one row per field, where row f has dim(f) elements and
+ * starts at offset(f). The interaction of a feature in field f1 with a
+ * feature in field f2 uses the first min(dim(f1), dim(f2)) elements of both
+ * rows.
+ */
+class FieldDims {
+ public:
+  /**
+   * \brief init the dims
+   *
+   * @param V_dims the dims of the fields separated by commas, such as "8,8,2".
+   * if empty, all fields have V_dim
+   */
+  void Init(const std::string& V_dims, int V_dim, int field_num) {
+    dims_.clear();
+    if (V_dims.empty()) {
+      dims_.assign(field_num, V_dim);
+    } else {
+      std::stringstream ss(V_dims);
+      std::string dim;
+      while (std::getline(ss, dim, ',')) {
+        dims_.push_back(atoi(dim.c_str()));
+        CHECK_GT(dims_.back(), 0) << "invalid V_dims: " << V_dims;
+      }
+      CHECK_EQ(dims_.size(), static_cast<size_t>(field_num))
+          << "V_dims should have field_num dims: " << V_dims;
+    }
+    offsets_.resize(field_num + 1);
+    offsets_[0] = 0;
+    for (int f = 0; f < field_num; ++f) offsets_[f+1] = offsets_[f] + dims_[f];
+    max_dim_ = dims_.empty() ? 0 : *std::max_element(dims_.begin(), dims_.end());
+  }
+  /** \brief the dim of row f */
+  inline int dim(int f) const { return dims_[f]; }
+  /** \brief the position of row f in V */
+  inline int offset(int f) const { return offsets_[f]; }
+  /** \brief the length of V */
+  inline int size() const { return offsets_.back(); }
+  /** \brief the maximal dim of a row */
+  inline int max_dim() const { return max_dim_; }
+  const std::vector<int>& dims() const { return dims_; }
+  /** \brief whether all fields have the same dim */
+  bool uniform() const {
+    return std::all_of(dims_.begin(), dims_.end(),
+                       [this](int d) { return d == dims_[0]; });
+  }
+  /**
+   * \brief the number of real_t slots of a row mask
+   *
+   * a row mask has one bit per field, 32 in the bits of each slot. it leads
+   * the rows of V sent in the packed form of \ref PackRows
+   */
+  inline int mask_size() const { return (dims_.size() + 31) / 32; }
+  /** \brief whether row f is set in a row mask */
+  static inline bool HasRow(real_t const* mask, int f) {
+    uint32_t bits; memcpy(&bits, mask + f / 32, sizeof(bits));
+    return (bits >> (f % 32)) & 1;
+  }
+  /**
+   * \brief write the row mask of the non-zero rows of V into out, followed by
+   * these rows. out should have room for mask_size() + size() elements.
+   * returns the number of elements written
+   *
+   * @param mask if given, V has only the rows in mask
+   */
+  int PackRows(real_t const* V, real_t* out, real_t const* mask = nullptr) const {
+    int n = mask_size(), p = n;
+    std::vector<uint32_t> bits(n, 0);
+    for (size_t f = 0; f < dims_.size(); ++f) {
+      if (mask && !HasRow(mask, f)) continue;
+      int dim = dims_[f];
+      real_t const* v = V + offsets_[f];
+      if (mask) { v = V; V += dim; }
+      if (std::all_of(v, v + dim, [](real_t x) { return x == 0; })) continue;
+      bits[f / 32] |= 1u << (f % 32);
+      memcpy(out + p, v, dim * sizeof(real_t));
+      p += dim;
+    }
+    memcpy(out, bits.data(), n * sizeof(real_t));
+    return p;
+  }
+  /** \brief the number of elements of the packed rows led by mask */
+  int PackedSize(real_t const* mask) const {
+    int p = mask_size();
+    for (size_t f = 0; f < dims_.size(); ++f) {
+      if (HasRow(mask, f)) p += dims_[f];
+    }
+    return p;
+  }
+  /** \brief format dims as the V_dims of Init */
+  static std::string Join(const std::vector<int>& dims) {
+    std::string s;
+    for (size_t f = 0; f < dims.size(); ++f) {
+      if (f) s += ",";
+      s += std::to_string(dims[f]);
+    }
+    return s;
+  }
+
+ private:
+  std::vector<int> dims_;
+  std::vector<int> offsets_{0};
+  int max_dim_ = 0;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_FIELD_DIMS_H_
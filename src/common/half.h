@@ -0,0 +1,146 @@
+/**
+ *  Copyright (c) 2016 by Contributors
+ * @file   half.h
+ * @brief  conversions between float and the 16-bit floats fp16 and bf16
+ */
+#ifndef DIFACTO_COMMON_HALF_H_
+#define DIFACTO_COMMON_HALF_H_
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+namespace difacto {
+
+/** \brief the next number of a xorshift generator, used for stochastic rounding */
+inline uint32_t XorShift32(uint32_t* state) {
+  uint32_t x = *state;
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+inline uint32_t FloatBits(float f) { uint32_t u; memcpy(&u, &f, 4); return u; }
+inline float BitsFloat(uint32_t u) { float f; memcpy(&f, &u, 4); return f; }
+
+/** \brief bf16 to float, which is exact */
+inline float BF16ToFloat(uint16_t h) {
+  return BitsFloat(static_cast<uint32_t>(h) << 16);
+}
+
+/**
+ * \brief float to bf16, rounded to nearest even
+ * @param r if not 0, rounds stochastically by adding the lower 16 bits of r,
+ * so that it is unbiased in expectation
+ */
+inline uint16_t FloatToBF16(float f, uint32_t r = 0) {
+  uint32_t u = FloatBits(f);
+  if ((u & 0x7fffffff) > 0x7f800000) return 0x7fc0;  // nan
+  if (r) {
+    u += r & 0xffff;
+  } else {
+    u += 0x7fff + ((u >> 16) & 1);
+  }
+  return u >> 16;
+}
+
+/** \brief fp16 to float, which is exact */
+inline float HalfToFloat(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  if (exp == 0) {
+    // zero or subnormal, mant * 2^-24
+    float f = mant * (1.0f / 16777216.0f);
+    return BitsFloat(FloatBits(f) | sign);
+  }
+  if (exp == 31) return BitsFloat(sign | 0x7f800000 | (mant << 13));
+  return BitsFloat(sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+/**
+ * \brief float to fp16, rounded to nearest even
+ * @param r if not 0, rounds stochastically by adding the lower 13 bits of r.
+ * subnormals are always rounded to nearest
+ */
+inline uint16_t FloatToHalf(float f, uint32_t r = 0) {
+  uint32_t u = FloatBits(f);
+  uint32_t sign = u & 0x80000000u;
+  u ^= sign;
+  uint16_t o;
+  if (u >= (143u << 23)) {
+    // overflow to inf, or nan
+    o = u > 0x7f800000 ? 0x7e00 : 0x7c00;
+  } else if (u < (113u << 23)) {
+    // subnormal, let the fpu align the mantissa
+    const uint32_t magic = 126u << 23;
+    o = FloatBits(BitsFloat(u) + BitsFloat(magic)) - magic;
+  } else {
+    u += static_cast<uint32_t>(15 - 127) << 23;
+    if (r) {
+      u += r & 0x1fff;
+      o = u >> 13;
+      if (o >= 0x7c00) o = 0x7bff;
+    } else {
+      u += 0xfff + ((u >> 13) & 1);
+      o = u >> 13;
+    }
+  }
+  return o | (sign >> 16);
+}
+
+/** \brief convert n bf16 into float */
+inline void BF16ToFloat(const uint16_t* src, size_t n, float* dst) {
+#pragma omp simd
+  for (size_t i = 0; i < n; ++i) dst[i] = BF16ToFloat(src[i]);
+}
+
+/**
+ * \brief convert n float into bf16
+ * @param rng if not null, rounds stochastically
+ */
+inline void FloatToBF16(const float* src, size_t n, uint16_t* dst,
+                        uint32_t* rng = nullptr) {
+  if (rng) {
+    for (size_t i = 0; i < n; ++i) dst[i] = FloatToBF16(src[i], XorShift32(rng));
+  } else {
+#pragma omp simd
+    for (size_t i = 0; i < n; ++i) dst[i] = FloatToBF16(src[i]);
+  }
+}
+
+/** \brief convert n fp16 into float, with f16c if available */
+inline void HalfToFloat(const uint16_t* src, size_t n, float* dst) {
+  size_t i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+#endif
+  for (; i < n; ++i) dst[i] = HalfToFloat(src[i]);
+}
+
+/**
+ * \brief convert n float into fp16, with f16c if available
+ * @param rng if not null, rounds stochastically
+ */
+inline void FloatToHalf(const float* src, size_t n, uint16_t* dst,
+                        uint32_t* rng = nullptr) {
+  size_t i = 0;
+  if (rng) {
+    for (; i < n; ++i) dst[i] = FloatToHalf(src[i], XorShift32(rng));
+    return;
+  }
+#ifdef __F16C__
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+  }
+#endif
+  for (; i < n; ++i) dst[i] = FloatToHalf(src[i]);
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_HALF_H_
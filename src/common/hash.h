@@ -0,0 +1,32 @@
+/**
+ *  Copyright (c) 2016 by Contributors
+ * @file   hash.h
+ * @brief  stateless hashing and random numbers
+ */
+#ifndef DIFACTO_COMMON_HASH_H_
+#define DIFACTO_COMMON_HASH_H_
+#include <stdint.h>
+namespace difacto {
+
+/** \brief the splitmix64 generator at state x, a good 64-bit mixer */
+inline uint64_t SplitMix64(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+/**
+ * \brief a counter-based uniform random number in [-1, 1)
+ *
+ * it is a pure function of (seed, key, idx), so it needs no state to be
+ * shared between threads, and is independent of the order of the calls
+ */
+inline float HashUniform(uint64_t seed, uint64_t key, uint32_t idx) {
+  uint64_t x = SplitMix64(SplitMix64(key ^ SplitMix64(seed)) + idx);
+  // the upper 24 bits, which are exact in a float
+  return static_cast<float>(x >> 40) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_HASH_H_
@@ -0,0 +1,112 @@
+/**
+ *  Copyright (c) 2016 by Contributors
+ * @file   space_saving.h
+ * @brief  the space-saving sketch of the most frequent keys
+ */
+#ifndef DIFACTO_COMMON_SPACE_SAVING_H_
+#define DIFACTO_COMMON_SPACE_SAVING_H_
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+namespace difacto {
+
+/**
+ * \brief the space-saving sketch, which keeps the heavy hitters of a stream
+ * with a fixed number of counters
+ *
+ * a new key replaces the key with the minimal count, and inherits that count.
+ * so the count of a key is overestimated by at most total / capacity, and any
+ * key with a larger true count is always kept. the counters are a min-heap, so
+ * an update costs O(log capacity).
+ */
+class SpaceSaving {
+ public:
+  SpaceSaving() { }
+  ~SpaceSaving() { }
+  /** \brief allocate capacity counters */
+  void Init(size_t capacity) {
+    CHECK_GT(capacity, 0U);
+    capacity_ = capacity;
+    heap_.clear(); heap_.reserve(capacity);
+    pos_.clear(); pos_.reserve(capacity);
+    total_ = 0;
+  }
+  /** \brief whether Init is called */
+  bool empty() const { return capacity_ == 0; }
+  /** \brief add cnt to a key */
+  void Add(feaid_t key, real_t cnt) {
+    total_ += cnt;
+    auto it = pos_.find(key);
+    size_t i;
+    if (it != pos_.end()) {
+      i = it->second;
+    } else if (heap_.size() < capacity_) {
+      // a new leaf, which may be smaller than its parents
+      i = heap_.size();
+      heap_.push_back(Counter{key, cnt});
+      pos_[key] = i;
+      SiftUp(i);
+      return;
+    } else {
+      // replace the minimal one, which is the root
+      i = 0;
+      pos_.erase(heap_[0].key);
+      heap_[0].key = key;
+      pos_[key] = 0;
+    }
+    heap_[i].count += cnt;
+    // the count only increases, so it only sinks
+    SiftDown(i);
+  }
+  /** \brief the (key, count) of the k largest counts, in descending order */
+  std::vector<std::pair<feaid_t, real_t>> Top(size_t k) const {
+    std::vector<Counter> top = heap_;
+    k = std::min(k, top.size());
+    std::partial_sort(top.begin(), top.begin() + k, top.end(),
+                      [](const Counter& a, const Counter& b) { return a.count > b.count; });
+    std::vector<std::pair<feaid_t, real_t>> ret(k);
+    for (size_t i = 0; i < k; ++i) ret[i] = std::make_pair(top[i].key, top[i].count);
+    return ret;
+  }
+  /** \brief the sum of all counts added */
+  double total() const { return total_; }
+
+ private:
+  struct Counter {
+    feaid_t key;
+    real_t count;
+  };
+  void SiftUp(size_t i) {
+    while (i > 0) {
+      size_t p = (i - 1) / 2;
+      if (heap_[p].count <= heap_[i].count) break;
+      std::swap(heap_[i], heap_[p]);
+      pos_[heap_[i].key] = i;
+      pos_[heap_[p].key] = p;
+      i = p;
+    }
+  }
+  void SiftDown(size_t i) {
+    size_t n = heap_.size();
+    while (true) {
+      size_t l = 2 * i + 1, m = i;
+      if (l < n && heap_[l].count < heap_[m].count) m = l;
+      if (l + 1 < n && heap_[l+1].count < heap_[m].count) m = l + 1;
+      if (m == i) break;
+      std::swap(heap_[i], heap_[m]);
+      pos_[heap_[i].key] = i;
+      pos_[heap_[m].key] = m;
+      i = m;
+    }
+  }
+  size_t capacity_ = 0;
+  std::vector<Counter> heap_;
+  /** \brief the position of a key in heap_ */
+  std::unordered_map<feaid_t, size_t> pos_;
+  double total_ = 0;
+};
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_SPACE_SAVING_H_
@@ -0,0 +1,77 @@
+/**
+ *  Copyright (c) 2016 by Contributors
+ * @file   text_format.h
+ * @brief  fast formatting of numbers into text
+ */
+#ifndef DIFACTO_COMMON_TEXT_FORMAT_H_
+#define DIFACTO_COMMON_TEXT_FORMAT_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+namespace difacto {
+
+/** \brief the maximal number of chars written by the formatters below */
+static const int kMaxFormatLen = 32;
+
+/** \brief write an unsigned integer into out, returns the end */
+inline char* FormatUInt(uint64_t x, char* out) {
+  char buf[24];
+  int n = 0;
+  do { buf[n++] = '0' + x % 10; x /= 10; } while (x);
+  while (n) *out++ = buf[--n];
+  return out;
+}
+
+/** \brief write an integer into out, returns the end */
+inline char* FormatInt(int64_t x, char* out) {
+  if (x < 0) {
+    *out++ = '-';
+    return FormatUInt(-static_cast<uint64_t>(x), out);
+  }
+  return FormatUInt(x, out);
+}
+
+/**
+ * \brief write a float as printf("%g") into out, returns the end
+ *
+ * a float in [1e-4, 1e6) is rounded into an integer with 6 significant digits
+ * and written without printf, which are almost all weights. a tie is rounded
+ * to even as printf does.
+ */
+inline char* FormatFloat(float v, char* out) {
+  static const double pow10[] = {
+    1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10};
+  if (v == 0) {
+    if (signbit(v)) *out++ = '-';
+    *out++ = '0';
+    return out;
+  }
+  double a = fabs(v);
+  if (!(a >= 1e-4 && a < 1e6)) {
+    // also nan and inf
+    return out + snprintf(out, kMaxFormatLen, "%g", v);
+  }
+  // a is in [10^e, 10^(e+1))
+  int e = 5;
+  while (a < pow10[e + 4] * 1e-4) --e;
+  int decimals = 5 - e;
+  uint64_t m = static_cast<uint64_t>(nearbyint(a * pow10[decimals]));
+  if (m >= 1000000) {
+    // rounded up into the next power of 10
+    if (decimals == 0) return out + snprintf(out, kMaxFormatLen, "%g", v);
+    m = static_cast<uint64_t>(nearbyint(a * pow10[--decimals]));
+  }
+  if (v < 0) *out++ = '-';
+  uint64_t scale = static_cast<uint64_t>(pow10[decimals]);
+  out = FormatUInt(m / scale, out);
+  uint64_t frac = m % scale;
+  if (frac == 0) return out;
+  // strip the trailing zeros
+  while (frac % 10 == 0) { frac /= 10; scale /= 10; }
+  *out++ = '.';
+  for (scale /= 10; scale > frac && scale > 1; scale /= 10) *out++ = '0';
+  return FormatUInt(frac, out);
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_TEXT_FORMAT_H_
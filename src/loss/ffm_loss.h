@@ -5,12 +5,15 @@
 #define DIFACTO_LOSS_FM_LOSS_H_
 #include <vector>
 #include <cmath>
+#include <string>
+#include <algorithm>
 #include "difacto/base.h"
 #include "dmlc/data.h"
 #include "dmlc/io.h"
 #include "difacto/loss.h"
 #include "common/spmv.h"
 #include "common/spmm.h"
+#include "common/field_dims.h"
 namespace difacto {
 /**
  * \brief parameters for FM loss
@@ -21,9 +24,12 @@ struct FFMLossParam : public dmlc::Parameter<FFMLossParam> {
    */
   int V_dim;
   int field_num;
+  /** \brief the per-field dims, see \ref FieldDims */
+  std::string V_dims;
   DMLC_DECLARE_PARAMETER(FFMLossParam) {
     DMLC_DECLARE_FIELD(V_dim).set_range(0, 10000);
     DMLC_DECLARE_FIELD(field_num).set_range(0, 10000);
+    DMLC_DECLARE_FIELD(V_dims).set_default("");
   }
 };
 /**
@@ -36,7 +42,7 @@ class FFMLoss : public Loss {
 
   KWArgs Init(const KWArgs& kwargs) override {
     auto remain = param_.InitAllowUnknown(kwargs);
-    feat_num = param_.V_dim * param_.field_num;
+    dims_.Init(param_.V_dims, param_.V_dim, param_.field_num);
     return remain;
   }
   /**
@@ -45,7 +51,8 @@ class FFMLoss : public Loss {
    * @param data the data
    * @param param input parameters
    * - param[0], real_t vector, the weights
-   * - param[1], int vector, the V positions
+   * - param[1], int vector, the positions of the field rows of V, field_num
+   *   for each feature, -1 if the row is not pulled
    * @param pred predict output, should be pre-allocated
    */
   void Predict(const dmlc::RowBlock<unsigned>& data,
@@ -63,8 +70,8 @@ class FFMLoss : public Loss {
                const SArray<int>& V_pos,
                SArray<real_t>* pred) {
     SArray<real_t> w = weights;
+    int nf = param_.field_num;
 
-    int V_dim = param_.V_dim;
 #pragma omp parallel num_threads(nthreads_)
     {
       Range rg = Range(0, data.size).Segment(
@@ -74,17 +81,19 @@ class FFMLoss : public Loss {
         if (data.offset[i] == data.offset[i+1]) continue;
         real_t p = 0.;
         for (size_t j1 = data.offset[i]; j1 < data.offset[i+1]; ++j1) {
-          int ind1 = data.index[j1];
-          if (V_pos[ind1] < 0) continue;
+          int const* pos1 = V_pos.data() + data.index[j1] * nf;
           int f1 = data.field[j1];
           for (size_t j2 = j1+1; j2 < data.offset[i+1]; ++j2) {
-            int ind2 = data.index[j2];
-            if (V_pos[ind2] < 0) continue;
             int f2 = data.field[j2];
+            int idx1 = pos1[f2];
+            int idx2 = V_pos[data.index[j2] * nf + f1];
+            if (idx1 < 0 || idx2 < 0) continue;
+            real_t const* v1 = weights.data() + idx1;
+            real_t const* v2 = weights.data() + idx2;
+            int dim = std::min(dims_.dim(f1), dims_.dim(f2));
             real_t ww = 0.;
-            for (int k = 0; k < V_dim; ++k) {
-              ww += weights[V_pos[ind1] + f2 * V_dim + k] * \
-                    weights[V_pos[ind2] + f1 * V_dim + k];
+            for (int k = 0; k < dim; ++k) {
+              ww += v1[k] * v2[k];
             }
             if (data.value) {
               real_t vv = data.value[j1] * data.value[j2];
@@ -107,7 +116,7 @@ class FFMLoss : public Loss {
    * @param data the data
    * @param param input parameters
    * - param[0], real_t vector, the weights
-   * - param[1], int vector, the V positions
+   * - param[1], int vector, the positions of the field rows of V, see \ref Predict
    * - param[2], real_t vector, the predict output
    * @param grad the results
    */
@@ -127,10 +136,10 @@ class FFMLoss : public Loss {
                 const SArray<int>& V_pos,
                 const SArray<real_t>& pred,
                 SArray<real_t>* grad) {
+    int nf = param_.field_num;
     // p = ...
     SArray<real_t> p; p.CopyFrom(pred);
     CHECK_EQ(p.size(), data.size);
-    int V_dim = param_.V_dim;
 #pragma omp parallel for num_threads(nthreads_)
     for (size_t i = 0; i < p.size(); ++i) {
       real_t y = data.label[i] > 0 ? 1 : -1;
@@ -146,14 +155,14 @@ class FFMLoss : public Loss {
       for (size_t i = 0; i < data.size; ++i) {
         if (data.offset[i] == data.offset[i+1]) continue;
         for (size_t j1 = data.offset[i]; j1 < data.offset[i+1]; ++j1) {
-          int ind1 = data.index[j1];
-          if (V_pos[ind1] < 0) continue;
+          int const* pos1 = V_pos.data() + data.index[j1] * nf;
           for (size_t j2 = j1+1; j2 < data.offset[i+1]; ++j2) {
-            int ind2 = data.index[j2];
-            if (V_pos[ind2] < 0) continue;
-            int idx1 = V_pos[ind1] + data.field[j2] * V_dim;
-            int idx2 = V_pos[ind2] + data.field[j1] * V_dim;
-            for (int k = 0; k < V_dim; ++k) {
+            int f1 = data.field[j1], f2 = data.field[j2];
+            int idx1 = pos1[f2];
+            int idx2 = V_pos[data.index[j2] * nf + f1];
+            if (idx1 < 0 || idx2 < 0) continue;
+            int dim = std::min(dims_.dim(f1), dims_.dim(f2));
+            for (int k = 0; k < dim; ++k) {
               if (data.value) {
                 real_t vv = data.value[j1] * data.value[j2];
                 (*grad)[idx1 + k] += weights[idx2 + k] * p[i] * vv;
@@ -174,7 +183,8 @@ class FFMLoss : public Loss {
 
  private:
   FFMLossParam param_;
-  int feat_num = 0;
+  /** \brief the layout of the field rows of V */
+  FieldDims dims_;
 };
 
 }  // namespace difacto
@@ -5,12 +5,14 @@
 #include "common/arg_parser.h"
 #include "dmlc/parameter.h"
 #include "reader/dump.h"
+#include "reader/convert.h"
 namespace difacto {
 
 enum DifactoTask {
   kTrain = 0,
   kDumpModel = 1,
   kPredict = 2,
+  kConvertModel = 3,
 };
 
 struct DifactoParam : public dmlc::Parameter<DifactoParam> {
@@ -19,6 +21,7 @@ struct DifactoParam : public dmlc::Parameter<DifactoParam> {
    * - train: train a model, which is the default
    * - dump: dump model to readable format
    * - predict: predict by using a trained model
+   * - convert: convert a model between the stream and the snapshot formats
    */
   int task;
   /** \brief the learner's type, required for a training task */
@@ -29,6 +32,7 @@ struct DifactoParam : public dmlc::Parameter<DifactoParam> {
         .add_enum("train", kTrain)
         .add_enum("dump", kDumpModel)
         .add_enum("pred", kPredict)
+        .add_enum("convert", kConvertModel)
         .describe("Task to be performed by the main program");
   }
 };
@@ -43,6 +47,7 @@ void WarnUnknownKWArgs(const DifactoParam& param, const KWArgs& remain) {
 
 DMLC_REGISTER_PARAMETER(DifactoParam);
 DMLC_REGISTER_PARAMETER(DumpParam);
+DMLC_REGISTER_PARAMETER(ConvertParam);
 
 }  // namespace difacto
 
@@ -80,6 +85,13 @@ int main(int argc, char *argv[]) {
       dumper.Run();
       }
       break;
+    case kConvertModel:
+      {
+      Convert converter;
+      WarnUnknownKWArgs(param, converter.Init(kwargs_remain));
+      converter.Run();
+      }
+      break;
     default:
       LOG(FATAL) << "unknown task: " << param.task;
       break;
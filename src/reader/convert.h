@@ -0,0 +1,58 @@
+/**
+ * Copyright (c) 2016 by Contributors
+ */
+#ifndef DIFACTO_READER_CONVERT_H_
+#define DIFACTO_READER_CONVERT_H_
+#include <string>
+#include "dmlc/parameter.h"
+#include "dmlc/io.h"
+#include "sgd/sgd_updater.h"
+namespace difacto {
+
+struct ConvertParam : public dmlc::Parameter<ConvertParam> {
+  /** \brief the model file to convert, either a stream or a snapshot */
+  std::string model_in;
+  /** \brief the converted model file */
+  std::string model_out;
+  /** \brief the format of model_out, see \ref SGDModelFormat */
+  int model_format;
+  /** \brief wether to keep the aux data */
+  bool has_aux;
+
+  DMLC_DECLARE_PARAMETER(ConvertParam) {
+    DMLC_DECLARE_FIELD(model_in).set_default("");
+    DMLC_DECLARE_FIELD(model_out).set_default("");
+    DMLC_DECLARE_FIELD(model_format).set_default(kModelSnapshot)
+        .add_enum("stream", kModelStream)
+        .add_enum("snapshot", kModelSnapshot)
+        .add_enum("compressed", kModelCompressed)
+        .add_enum("compressed_int8", kModelCompressedInt8);
+    DMLC_DECLARE_FIELD(has_aux).set_default(true);
+  };
+};
+/**
+ * \brief convert a sgd model between the formats, see \ref SGDModelFormat
+ */
+class Convert {
+ public:
+  KWArgs Init(const KWArgs& kwargs) {
+    auto remain = param_.InitAllowUnknown(kwargs);
+    return remain;
+  }
+
+  void Run() {
+    CHECK(param_.model_in.size()) << "Pls set model_in";
+    CHECK(param_.model_out.size()) << "Pls set model_out";
+    // not inited, so it uses the configuration of model_in
+    SGDUpdater updater;
+    updater.LoadModel(param_.model_in);
+    updater.SaveModel(param_.model_out, param_.model_format, param_.has_aux);
+  }
+
+ private:
+  ConvertParam param_;
+};
+
+}  // namespace difacto
+
+#endif  // DIFACTO_READER_CONVERT_H_
@@ -4,6 +4,8 @@
 #ifndef DIFACTO_READER_DUMP_H_
 #define DIFACTO_READER_DUMP_H_
 #include <string>
+#include <vector>
+#include <memory>
 #include "dmlc/parameter.h"
 #include "dmlc/io.h"
 #include "sgd/sgd_updater.h"
@@ -20,13 +22,19 @@ struct DumpParam : public dmlc::Parameter<DumpParam> {
   bool need_reverse;
   /** \brief wether dump aux data */
   bool dump_aux;
-  
+  /**
+   * \brief if > 1, the model is dumped into name_dump_part-0, 1, ..., each
+   * of which is a key range written by its own thread
+   */
+  int num_parts;
+
   DMLC_DECLARE_PARAMETER(DumpParam) {
     DMLC_DECLARE_FIELD(updater).set_default("sgd");
     DMLC_DECLARE_FIELD(model_in).set_default("");
     DMLC_DECLARE_FIELD(name_dump).set_default("dump.txt");
     DMLC_DECLARE_FIELD(need_reverse).set_default(false);
     DMLC_DECLARE_FIELD(dump_aux).set_default(false);
+    DMLC_DECLARE_FIELD(num_parts).set_range(1, 1 << 20).set_default(1);
   };
 };
 /**
@@ -52,14 +60,25 @@ class Dump {
       LOG(FATAL) << "Unkonwn updater: " << param_.updater;
     }
 
-    std::unique_ptr<dmlc::Stream> fi(
-            dmlc::Stream::Create(param_.model_in.c_str(), "r"));
-    updater_->Load(fi.get());
+    // either a stream or a snapshot
+    std::static_pointer_cast<SGDUpdater>(updater_)->LoadModel(param_.model_in);
 
     // dump model
-    std::unique_ptr<dmlc::Stream> fo(
-            dmlc::Stream::Create(param_.name_dump.c_str(), "w"));
-    updater_->Dump(param_.dump_aux, param_.need_reverse, fo.get());
+    if (param_.num_parts == 1) {
+      std::unique_ptr<dmlc::Stream> fo(
+          dmlc::Stream::Create(param_.name_dump.c_str(), "w"));
+      updater_->Dump(param_.dump_aux, param_.need_reverse, fo.get());
+      return;
+    }
+    std::vector<std::unique_ptr<dmlc::Stream>> fos(param_.num_parts);
+    std::vector<dmlc::Stream*> parts(param_.num_parts);
+    for (int i = 0; i < param_.num_parts; ++i) {
+      std::string name = param_.name_dump + "_part-" + std::to_string(i);
+      fos[i].reset(dmlc::Stream::Create(name.c_str(), "w"));
+      parts[i] = fos[i].get();
+    }
+    std::static_pointer_cast<SGDUpdater>(updater_)->DumpParts(
+        param_.dump_aux, param_.need_reverse, parts);
   }
 
  private:
@@ -51,12 +51,14 @@ class WorkloadPool {
     return remain;
   }
 
-  void Add(int num_parts) {
+  /*! \brief add the parts 0, ..., num_parts-1 except for the ones in skip */
+  void Add(int num_parts, const std::vector<int>& skip = {}) {
     std::lock_guard<std::mutex> lk(mu_);
     for (int i = 0; i < num_parts; ++i) {
       track_[i] = 0;
     }
     CHECK_EQ(track_.size(), (size_t)num_parts);
+    for (int i : skip) track_.erase(i);
     inited_ = true;
   }
 
@@ -0,0 +1,305 @@
+/**
+ * Copyright (c) 2016 by Contributors
+ * @file   cold_store.h
+ * @brief  a log-structured key-value file for entries evicted from memory
+ */
+#ifndef DIFACTO_SGD_COLD_STORE_H_
+#define DIFACTO_SGD_COLD_STORE_H_
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+namespace difacto {
+
+/**
+ * \brief an append-only file with an in-memory index
+ *
+ * a record is (key, length, bytes). Put always appends, so the old record of
+ * the key becomes garbage, which is reclaimed by \ref Compact. The appended
+ * records are buffered in memory until \ref Flush writes them with a single
+ * write.
+ *
+ * It is thread-safe. \ref Flush and \ref Compact do the disk writes without
+ * blocking Put and Get, except for the short swap at the end of Compact.
+ */
+class ColdStore {
+ public:
+  ColdStore() { }
+  ~ColdStore() { Close(); }
+
+  /** \brief open an empty store, an existing file is truncated */
+  void Open(const std::string& filename) {
+    Close();
+    std::lock_guard<std::mutex> lk(mu_);
+    filename_ = filename;
+    fd_ = open(filename_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK_GE(fd_, 0) << "failed to open " << filename_;
+  }
+  /** \brief close and remove the file */
+  void Close() {
+    std::lock_guard<std::mutex> io(io_mu_);
+    std::lock_guard<std::mutex> lk(mu_);
+    if (fd_ < 0) return;
+    close(fd_); fd_ = -1;
+    unlink(filename_.c_str());
+    index_.clear();
+    buf_.clear();
+    end_ = 0; buf_off_ = 0; flush_off_ = 0; live_bytes_ = 0;
+  }
+  bool is_open() const { return fd_ >= 0; }
+  /** \brief the number of keys */
+  size_t size() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return index_.size();
+  }
+  bool Has(feaid_t key) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return index_.count(key) != 0;
+  }
+  /** \brief the keys, in no particular order */
+  std::vector<feaid_t> Keys() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    std::vector<feaid_t> keys;
+    keys.reserve(index_.size());
+    for (const auto& it : index_) keys.push_back(it.first);
+    return keys;
+  }
+  /** \brief the size of the file in bytes, including the buffered records */
+  size_t FileSize() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return end_;
+  }
+
+  /** \brief append a record for the key into the write buffer */
+  void Put(feaid_t key, const std::string& value) {
+    std::lock_guard<std::mutex> lk(mu_);
+    EraseLocked(key);
+    uint32_t len = value.size();
+    buf_.append(reinterpret_cast<const char*>(&key), sizeof(key));
+    buf_.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    buf_.append(value);
+    index_[key] = Pos{end_ + sizeof(key) + sizeof(len), len};
+    end_ += sizeof(key) + sizeof(len) + len;
+    live_bytes_ += sizeof(key) + sizeof(len) + len;
+  }
+  /** \brief read the value of a key, returns false if not found */
+  bool Get(feaid_t key, std::string* value) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = index_.find(key);
+    if (it == index_.end()) return false;
+    value->resize(it->second.len);
+    Read(&(*value)[0], it->second.len, it->second.offset);
+    return true;
+  }
+  /** \brief remove a key, its record becomes garbage */
+  void Erase(feaid_t key) {
+    std::lock_guard<std::mutex> lk(mu_);
+    EraseLocked(key);
+  }
+  /**
+   * \brief call fn(key, value) on every key in the order of the file, which
+   * reads the file sequentially. fn must not call the other functions of
+   * this store
+   */
+  template <typename Fn>
+  void ForEach(const Fn& fn) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    Reader in(this);
+    std::string value;
+    uint64_t off = 0;
+    while (off < end_) {
+      feaid_t key; uint32_t len;
+      in.Read(&key, sizeof(key), off);
+      in.Read(&len, sizeof(len), off + sizeof(key));
+      uint64_t pos = off + sizeof(key) + sizeof(len);
+      auto it = index_.find(key);
+      if (it != index_.end() && it->second.offset == pos) {
+        value.resize(len);
+        in.Read(&value[0], len, pos);
+        fn(key, value);
+      }
+      off = pos + len;
+    }
+  }
+  /**
+   * \brief write the buffered records into the file with a single write
+   */
+  void Flush() {
+    std::lock_guard<std::mutex> io(io_mu_);
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      if (buf_.empty()) return;
+      // keep the records readable from flush_buf_ until they are written
+      flush_buf_.swap(buf_);
+      flush_off_ = buf_off_;
+      buf_off_ = end_;
+    }
+    // only Flush changes flush_buf_, so it is read without the lock
+    WriteAt(fd_, flush_buf_.data(), flush_buf_.size(), flush_off_);
+    std::lock_guard<std::mutex> lk(mu_);
+    flush_buf_.clear();
+  }
+  /**
+   * \brief rewrite the live records into a new file if more than half of the
+   * file is garbage and the garbage is larger than min_garbage bytes
+   *
+   * the file is copied without holding the lock. records put or erased
+   * meanwhile are carried over when the new file is swapped in.
+   */
+  void Compact(size_t min_garbage = 64 << 20) {
+    Flush();
+    std::lock_guard<std::mutex> io(io_mu_);
+    std::unordered_map<feaid_t, Pos> index;
+    uint64_t snap_end;
+    size_t garbage;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      garbage = end_ - live_bytes_;
+      if (garbage < min_garbage || garbage < live_bytes_) return;
+      index = index_;
+      snap_end = buf_off_;
+    }
+    std::string tmp = filename_ + ".compact";
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK_GE(fd, 0) << "failed to open " << tmp;
+    // the new offset of the value of every record copied, by its old offset
+    std::unordered_map<uint64_t, uint64_t> moved;
+    moved.reserve(index.size());
+    std::string out;
+    uint64_t end = 0;
+    Reader in(this);
+    for (uint64_t off = 0; off < snap_end; ) {
+      feaid_t key; uint32_t len;
+      in.ReadFile(&key, sizeof(key), off);
+      in.ReadFile(&len, sizeof(len), off + sizeof(key));
+      uint64_t pos = off + sizeof(key) + sizeof(len);
+      auto it = index.find(key);
+      if (it != index.end() && it->second.offset == pos) {
+        size_t n = out.size();
+        out.resize(n + sizeof(key) + sizeof(len) + len);
+        memcpy(&out[n], &key, sizeof(key));
+        memcpy(&out[n + sizeof(key)], &len, sizeof(len));
+        in.ReadFile(&out[n + sizeof(key) + sizeof(len)], len, pos);
+        moved[pos] = end + n + sizeof(key) + sizeof(len);
+      }
+      if (out.size() >= kChunk) {
+        WriteAt(fd, out.data(), out.size(), end);
+        end += out.size();
+        out.clear();
+      }
+      off = pos + len;
+    }
+    WriteAt(fd, out.data(), out.size(), end);
+    end += out.size();
+
+    std::lock_guard<std::mutex> lk(mu_);
+    // nothing was flushed meanwhile, as Flush waits for io_mu_, so the records
+    // put after the snapshot are all in the write buffer
+    CHECK_EQ(buf_off_, snap_end);
+    std::unordered_map<feaid_t, Pos> new_index;
+    new_index.reserve(index_.size());
+    for (const auto& it : index_) {
+      Pos p = it.second;
+      if (p.offset >= snap_end) {
+        p.offset = p.offset - snap_end + end;
+      } else {
+        auto m = moved.find(p.offset);
+        CHECK(m != moved.end());
+        p.offset = m->second;
+      }
+      new_index[it.first] = p;
+    }
+    CHECK_EQ(rename(tmp.c_str(), filename_.c_str()), 0);
+    close(fd_);
+    fd_ = fd;
+    index_.swap(new_index);
+    end_ = end + buf_.size();
+    buf_off_ = end;
+    LOG(INFO) << "compacted " << filename_ << ", " << (garbage >> 20) << " MB reclaimed";
+  }
+
+ private:
+  static const size_t kChunk = 4 << 20;
+  /** \brief the position of a value */
+  struct Pos {
+    uint64_t offset;
+    uint32_t len;
+  };
+  /** \brief reads the file through a buffer of kChunk bytes */
+  class Reader {
+   public:
+    explicit Reader(const ColdStore* store) : store_(store) { }
+    /** \brief read from the file or the write buffers, with the lock held */
+    void Read(void* buf, size_t len, uint64_t off) {
+      if (off >= store_->FileEnd()) {
+        store_->Read(buf, len, off);
+      } else {
+        ReadFile(buf, len, off);
+      }
+    }
+    /** \brief read from the file only */
+    void ReadFile(void* buf, size_t len, uint64_t off) {
+      if (off < off_ || off + len > off_ + chunk_.size()) {
+        chunk_.resize(len > kChunk ? len : kChunk);
+        ssize_t n = pread(store_->fd_, &chunk_[0], chunk_.size(), off);
+        CHECK_GE(n, (ssize_t)len) << "failed to read " << store_->filename_;
+        chunk_.resize(n);
+        off_ = off;
+      }
+      memcpy(buf, chunk_.data() + (off - off_), len);
+    }
+
+   private:
+    const ColdStore* store_;
+    std::string chunk_;
+    uint64_t off_ = 0;
+  };
+
+  void EraseLocked(feaid_t key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) return;
+    live_bytes_ -= sizeof(key) + sizeof(uint32_t) + it->second.len;
+    index_.erase(it);
+  }
+  /** \brief the end of the records written into the file */
+  uint64_t FileEnd() const { return flush_buf_.empty() ? buf_off_ : flush_off_; }
+  /** \brief read from the write buffers or the file, with the lock held */
+  void Read(void* buf, size_t len, uint64_t off) const {
+    if (off >= buf_off_) {
+      memcpy(buf, buf_.data() + (off - buf_off_), len);
+    } else if (flush_buf_.size() && off >= flush_off_) {
+      memcpy(buf, flush_buf_.data() + (off - flush_off_), len);
+    } else {
+      CHECK_EQ(pread(fd_, buf, len, off), (ssize_t)len) << "failed to read " << filename_;
+    }
+  }
+  void WriteAt(int fd, const void* buf, size_t len, uint64_t off) {
+    CHECK_EQ(pwrite(fd, buf, len, off), (ssize_t)len) << "failed to write " << filename_;
+  }
+  std::string filename_;
+  int fd_ = -1;
+  /** \brief the end of the file, including the write buffer */
+  uint64_t end_ = 0;
+  /** \brief the bytes of the live records */
+  uint64_t live_bytes_ = 0;
+  std::unordered_map<feaid_t, Pos> index_;
+  /** \brief the records not written yet, which start at buf_off_ */
+  std::string buf_;
+  uint64_t buf_off_ = 0;
+  /** \brief the records being written by Flush, which start at flush_off_ */
+  std::string flush_buf_;
+  uint64_t flush_off_ = 0;
+  /** \brief guards the members above */
+  mutable std::mutex mu_;
+  /** \brief serializes Flush, Compact and Close, which use fd_ */
+  std::mutex io_mu_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_SGD_COLD_STORE_H_
@@ -0,0 +1,314 @@
+/**
+ * Copyright (c) 2016 by Contributors
+ * @file   grad_codec.h
+ * @brief  the compression of the pushed gradients with error feedback
+ */
+#ifndef DIFACTO_SGD_GRAD_CODEC_H_
+#define DIFACTO_SGD_GRAD_CODEC_H_
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "common/field_dims.h"
+#include "common/half.h"
+namespace difacto {
+
+/**
+ * \brief the number of real_t slots of a row of dim elements quantized into
+ * bits, which is a scale followed by the codes
+ */
+inline int QuantSize(int dim, int bits) {
+  return 1 + (dim * bits + 31) / 32;
+}
+
+/**
+ * \brief quantize a row into bits per element by stochastic rounding
+ *
+ * an element is g / max|g| rounded into one of 2^bits - 1 levels in [-1, 1].
+ * g is set to the decoded values, so that g minus them is the error
+ *
+ * @param out QuantSize(dim, bits) slots
+ */
+inline void QuantizeRow(int dim, int bits, real_t* g, uint32_t* rng, real_t* out) {
+  real_t scale = 0;
+  for (int k = 0; k < dim; ++k) scale = std::max(scale, fabsf(g[k]));
+  int levels = (1 << (bits - 1)) - 1;
+  out[0] = scale;
+  std::vector<uint32_t> codes((dim * bits + 31) / 32, 0);
+  for (int k = 0; k < dim; ++k) {
+    int q = 0;
+    if (scale > 0) {
+      real_t u = (XorShift32(rng) >> 8) * (1.0f / (1 << 24));
+      q = static_cast<int>(floorf(g[k] / scale * levels + u));
+      q = std::min(std::max(q, -levels), levels);
+    }
+    codes[k * bits / 32] |= static_cast<uint32_t>(q + levels) << (k * bits % 32);
+    g[k] = q * scale / levels;
+  }
+  memcpy(out + 1, codes.data(), codes.size() * sizeof(real_t));
+}
+
+/** \brief decode a row quantized by \ref QuantizeRow into g */
+inline void DequantizeRow(int dim, int bits, real_t const* in, real_t* g) {
+  real_t scale = in[0];
+  int levels = (1 << (bits - 1)) - 1;
+  uint32_t mask = (1u << bits) - 1;
+  for (int k = 0; k < dim; ++k) {
+    uint32_t word; memcpy(&word, in + 1 + k * bits / 32, sizeof(word));
+    int q = static_cast<int>((word >> (k * bits % 32)) & mask) - levels;
+    g[k] = q * scale / levels;
+  }
+}
+
+/**
+ * \brief decode the quantized rows of the features pushed by \ref
+ * GradCompressor into the packed rows of \ref FieldDims::PackRows
+ *
+ * @param ver the number of slots in front of the row mask of a feature
+ */
+inline void DequantizeRows(const FieldDims& dims, int bits, int ver,
+                           const SArray<real_t>& codes, const SArray<int>& lens,
+                           SArray<real_t>* rows, SArray<int>* rows_lens) {
+  int mask_size = dims.mask_size();
+  size_t n = lens.size();
+  rows->resize(n * (ver + dims.size() + mask_size));
+  rows_lens->resize(n);
+  int p = 0, q = 0;
+  for (size_t i = 0; i < n; ++i) {
+    (*rows_lens)[i] = 0;
+    if (lens[i] == 0) continue;
+    real_t const* in = codes.data() + p;
+    real_t* out = rows->data() + q;
+    memcpy(out, in, (ver + mask_size) * sizeof(real_t));
+    real_t const* mask = in + ver;
+    int a = ver + mask_size, b = ver + mask_size;
+    for (int f = 0; f < static_cast<int>(dims.dims().size()); ++f) {
+      if (!FieldDims::HasRow(mask, f)) continue;
+      DequantizeRow(dims.dim(f), bits, in + a, out + b);
+      a += QuantSize(dims.dim(f), bits);
+      b += dims.dim(f);
+    }
+    CHECK_EQ(a, lens[i]);
+    (*rows_lens)[i] = b;
+    p += a; q += b;
+  }
+  rows->resize(q);
+}
+
+/**
+ * \brief compress the gradients a worker pushes, with error feedback
+ *
+ * the all-zero rows and the rows of the smallest norms are dropped, and the
+ * others are optionally quantized. what is not sent of a row is kept as its residual, and added to
+ * the gradient of the row when the feature is pushed again, so it is delayed
+ * rather than lost. a residual is dropped once it is all zero, or the feature
+ * is not pushed again within max_age pushes. it is thread-safe.
+ */
+class GradCompressor {
+ public:
+  /**
+   * @param bits 8 or 4 to quantize the rows, 0 to send them in fp32
+   * @param topk the fraction of the non-zero rows of a push to send
+   * @param max_age the pushes a residual is kept without its feature pushed
+   * again, 0 to keep it until it is added back
+   */
+  void Init(const FieldDims& dims, int bits, real_t topk, int max_age, uint32_t seed) {
+    CHECK(bits == 0 || bits == 4 || bits == 8) << "invalid grad_bits " << bits;
+    CHECK(topk > 0 && topk <= 1) << "invalid grad_topk " << topk;
+    dims_ = dims; bits_ = bits; topk_ = topk; max_age_ = max_age;
+    rng_ = seed | 1;
+  }
+
+  /**
+   * \brief add the residuals into the gradients of the rows pulled
+   * @param V_pos the positions of the rows, see \ref FFMLoss::Predict
+   */
+  void AddResidual(const SArray<feaid_t>& feaids, const SArray<int>& V_pos,
+                   SArray<real_t>* grads) {
+    int nf = dims_.dims().size();
+    std::lock_guard<std::mutex> lk(mu_);
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      auto it = residuals_.find(feaids[i]);
+      if (it == residuals_.end()) continue;
+      real_t* r = it->second.r.data();
+      for (int f = 0; f < nf; ++f) {
+        int pos = V_pos[i * nf + f];
+        if (pos < 0) continue;
+        real_t* g = grads->data() + pos;
+        real_t* rf = r + dims_.offset(f);
+        for (int k = 0; k < dims_.dim(f); ++k) { g[k] += rf[k]; rf[k] = 0; }
+      }
+      if (IsZero(r)) residuals_.erase(it);
+    }
+  }
+
+  /**
+   * \brief compress the packed rows of \ref FieldDims::PackRows in place, and
+   * keep the residuals. the rows are quantized if bits > 0
+   */
+  void Compress(const SArray<feaid_t>& feaids, SArray<real_t>* rows,
+                SArray<int>* lens) {
+    int nf = dims_.dims().size(), mask_size = dims_.mask_size();
+    size_t n = lens->size();
+    // the norm of the k-th largest non-zero row
+    real_t threshold = 0;
+    if (topk_ < 1) {
+      std::vector<real_t> norms;
+      ForEachRow(*rows, *lens, [&](size_t i, int f, real_t* g) {
+          real_t norm = SquaredNorm(g, dims_.dim(f));
+          if (norm > 0) norms.push_back(norm);
+        });
+      size_t k = static_cast<size_t>(ceil(norms.size() * topk_));
+      if (k > 0 && k < norms.size()) {
+        std::nth_element(norms.begin(), norms.begin() + k - 1, norms.end(),
+                         std::greater<real_t>());
+        threshold = norms[k - 1];
+      }
+    }
+    // a quantized row has at most one more slot, its scale
+    SArray<real_t> out(rows->size() * 2);
+    int p = 0, q = 0;
+    size_t raw = 0;
+    double residual = 0;
+    std::lock_guard<std::mutex> lk(mu_);
+    ++ num_pushes_;
+    for (size_t i = 0; i < n; ++i) {
+      int l = (*lens)[i];
+      if (l == 0) continue;
+      real_t* in = rows->data() + p;
+      real_t* mask = out.data() + q;
+      memcpy(mask, in, mask_size * sizeof(real_t));
+      int b = mask_size;
+      auto it = residuals_.find(feaids[i]);
+      real_t* r = it == residuals_.end() ? nullptr : it->second.r.data();
+      real_t* g = in + mask_size;
+      for (int f = 0; f < nf; ++f) {
+        if (!FieldDims::HasRow(in, f)) continue;
+        int dim = dims_.dim(f);
+        real_t norm = SquaredNorm(g, dim);
+        // a zero row is dropped with nothing left of it
+        bool zero = norm == 0;
+        bool drop = zero || (threshold > 0 && norm < threshold);
+        if (!r && !zero && (drop || bits_)) {
+          it = residuals_.emplace(feaids[i], Residual()).first;
+          it->second.r.resize(dims_.size());
+          r = it->second.r.data();
+        }
+        // added to, as another push of the feature may have left some since
+        // AddResidual
+        real_t* rf = r ? r + dims_.offset(f) : nullptr;
+        if (drop) {
+          // dropped, all of it is left
+          for (int k = 0; rf && k < dim; ++k) rf[k] += g[k];
+          ClearRow(mask, f);
+        } else if (bits_) {
+          for (int k = 0; k < dim; ++k) rf[k] += g[k];
+          QuantizeRow(dim, bits_, g, &rng_, out.data() + q + b);
+          for (int k = 0; k < dim; ++k) rf[k] -= g[k];
+          b += QuantSize(dim, bits_);
+        } else {
+          memcpy(out.data() + q + b, g, dim * sizeof(real_t));
+          b += dim;
+        }
+        for (int k = 0; rf && k < dim; ++k) residual += rf[k] * rf[k];
+        g += dim;
+      }
+      if (r) {
+        if (IsZero(r)) {
+          residuals_.erase(it);
+        } else {
+          it->second.stamp = num_pushes_;
+        }
+      }
+      raw += l;
+      p += l; q += b;
+      (*lens)[i] = b;
+    }
+    if (max_age_ > 0 && num_pushes_ % max_age_ == 0) {
+      // drop the residuals of the features not pushed for max_age pushes
+      for (auto it = residuals_.begin(); it != residuals_.end(); ) {
+        if (num_pushes_ - it->second.stamp >= static_cast<uint32_t>(max_age_)) {
+          it = residuals_.erase(it);
+        } else {
+          ++ it;
+        }
+      }
+    }
+    out.resize(q);
+    *rows = out;
+    raw_ += raw * sizeof(real_t);
+    sent_ += q * sizeof(real_t);
+    residual_ += residual;
+  }
+
+  /**
+   * \brief the bytes of the packed rows before and after the compression, and
+   * the sum of the squares of the residuals left by each push, since the
+   * last call
+   */
+  void TakeStats(real_t* raw, real_t* sent, real_t* residual) {
+    std::lock_guard<std::mutex> lk(mu_);
+    *raw = raw_; *sent = sent_; *residual = residual_;
+    raw_ = sent_ = 0; residual_ = 0;
+  }
+
+ private:
+  inline real_t SquaredNorm(real_t const* g, int dim) const {
+    real_t s = 0;
+    for (int k = 0; k < dim; ++k) s += g[k] * g[k];
+    return s;
+  }
+  inline bool IsZero(real_t const* r) const {
+    for (int k = 0; k < dims_.size(); ++k) {
+      if (r[k] != 0) return false;
+    }
+    return true;
+  }
+  static inline void ClearRow(real_t* mask, int f) {
+    uint32_t bits; memcpy(&bits, mask + f / 32, sizeof(bits));
+    bits &= ~(1u << (f % 32));
+    memcpy(mask + f / 32, &bits, sizeof(bits));
+  }
+  /** \brief call fn(i, f, g) on row f of feature i of the packed rows */
+  template <typename Fn>
+  void ForEachRow(const SArray<real_t>& rows, const SArray<int>& lens, const Fn& fn) {
+    int nf = dims_.dims().size(), mask_size = dims_.mask_size();
+    int p = 0;
+    for (size_t i = 0; i < lens.size(); ++i) {
+      if (lens[i] == 0) continue;
+      real_t* mask = rows.data() + p;
+      real_t* g = mask + mask_size;
+      for (int f = 0; f < nf; ++f) {
+        if (!FieldDims::HasRow(mask, f)) continue;
+        fn(i, f, g);
+        g += dims_.dim(f);
+      }
+      p += lens[i];
+    }
+  }
+
+  /** \brief the residual of a feature, and the push which last changed it */
+  struct Residual {
+    std::vector<real_t> r;
+    uint32_t stamp = 0;
+  };
+  FieldDims dims_;
+  int bits_ = 0;
+  real_t topk_ = 1;
+  int max_age_ = 0;
+  uint32_t rng_ = 1;
+  uint32_t num_pushes_ = 0;
+  std::unordered_map<feaid_t, Residual> residuals_;
+  std::mutex mu_;
+  double raw_ = 0, sent_ = 0, residual_ = 0;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_SGD_GRAD_CODEC_H_
@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2016 by Contributors
+ * @file   sgd_codec.h
+ * @brief  the encodings of the blocks of a compressed model
+ */
+#ifndef DIFACTO_SGD_SGD_CODEC_H_
+#define DIFACTO_SGD_SGD_CODEC_H_
+#if DIFACTO_USE_LZ4
+#include <lz4.h>
+#endif  // DIFACTO_USE_LZ4
+#include <math.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+namespace difacto {
+namespace codec {
+
+/**
+ * \brief append sorted keys as varints of the differences between neighbors,
+ * the first one is the difference from 0
+ */
+inline void EncodeKeys(const feaid_t* keys, size_t n, std::string* out) {
+  feaid_t prev = 0;
+  for (size_t i = 0; i < n; ++i) {
+    feaid_t d = keys[i] - prev;
+    prev = keys[i];
+    while (d >= 0x80) {
+      out->push_back(static_cast<char>(d | 0x80));
+      d >>= 7;
+    }
+    out->push_back(static_cast<char>(d));
+  }
+}
+
+/** \brief decode n keys encoded by \ref EncodeKeys, returns the bytes read */
+inline size_t DecodeKeys(const char* in, size_t size, size_t n, feaid_t* keys) {
+  size_t p = 0;
+  feaid_t prev = 0;
+  for (size_t i = 0; i < n; ++i) {
+    feaid_t d = 0;
+    int shift = 0;
+    while (true) {
+      CHECK_LT(p, size) << "corrupted keys";
+      uint8_t b = in[p++];
+      d |= static_cast<feaid_t>(b & 0x7f) << shift;
+      if (b < 0x80) break;
+      shift += 7;
+    }
+    prev += d;
+    keys[i] = prev;
+  }
+  return p;
+}
+
+/** \brief append the lz4 compressed data to out */
+inline void Compress(const char* data, size_t size, std::string* out) {
+#if DIFACTO_USE_LZ4
+  int bound = LZ4_compressBound(size);
+  size_t pos = out->size();
+  out->resize(pos + bound);
+  int actual = LZ4_compress_default(data, &(*out)[pos], size, bound);
+  CHECK_NE(actual, 0);
+  out->resize(pos + actual);
+#else
+  LOG(FATAL) << "compile with USE_LZ4=1";
+#endif
+}
+
+/** \brief decompress size bytes into dst with dst_size bytes */
+inline void Decompress(const char* data, size_t size, char* dst, size_t dst_size) {
+#if DIFACTO_USE_LZ4
+  CHECK_EQ(static_cast<int>(dst_size), LZ4_decompress_safe(
+      data, dst, size, dst_size)) << "corrupted block";
+#else
+  LOG(FATAL) << "compile with USE_LZ4=1";
+#endif
+}
+
+/** \brief the bytes of n values quantized by \ref QuantizeInt8 */
+inline size_t Int8Bytes(int n) { return sizeof(real_t) + n; }
+
+/**
+ * \brief quantize n values into a scale followed by n int8, which are the
+ * values divided by the scale and rounded
+ */
+inline void QuantizeInt8(real_t const* v, int n, char* out) {
+  real_t amax = 0;
+  for (int i = 0; i < n; ++i) amax = std::max(amax, static_cast<real_t>(fabs(v[i])));
+  real_t scale = amax / 127;
+  memcpy(out, &scale, sizeof(scale));
+  int8_t* q = reinterpret_cast<int8_t*>(out + sizeof(scale));
+  for (int i = 0; i < n; ++i) {
+    q[i] = scale == 0 ? 0 : static_cast<int8_t>(lrintf(v[i] / scale));
+  }
+}
+
+/** \brief the inverse of \ref QuantizeInt8 */
+inline void DequantizeInt8(const char* in, int n, real_t* v) {
+  real_t scale;
+  memcpy(&scale, in, sizeof(scale));
+  const int8_t* q = reinterpret_cast<const int8_t*>(in + sizeof(scale));
+  for (int i = 0; i < n; ++i) v[i] = q[i] * scale;
+}
+
+}  // namespace codec
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_CODEC_H_
@@ -3,10 +3,13 @@
  */
 #include "./sgd_learner.h"
 #include <stdlib.h>
+#include <string.h>
 #include <memory>
 #include <thread>
 #include <vector>
 #include <utility>
+#include <sstream>
+#include <algorithm>
 #include "dmlc/timer.h"
 #include "reader/batch_reader.h"
 #include "tracker/async_local_tracker.h"
@@ -21,6 +24,8 @@ struct BatchJob {
   int type;
   SArray<feaid_t> feaids;
   SharedRowBlockContainer<unsigned> data;
+  /** \brief the row masks to pull by, empty to pull all rows */
+  SArray<real_t> masks;
 };
 
 KWArgs SGDLearner::Init(const KWArgs& kwargs) {
@@ -28,6 +33,14 @@ KWArgs SGDLearner::Init(const KWArgs& kwargs) {
   auto remain = Learner::Init(kwargs);
   // init param
   remain = param_.InitAllowUnknown(remain);
+  CHECK(param_.num_deltas == 0 || param_.model_format == kModelSnapshot)
+      << "num_deltas needs model_format=snapshot";
+  CHECK(param_.model_out.size() || (param_.journal.empty() && param_.checkpoint_parts == 0))
+      << "journal and checkpoint_parts need model_out";
+  // the chain of the checkpoints has one owner, either each server or the scheduler
+  CHECK((param_.checkpoint_interval == 0 && param_.checkpoint_batches == 0) ||
+        (param_.journal.empty() && param_.checkpoint_parts == 0))
+      << "periodic checkpoints cannot be used with journal or checkpoint_parts";
   // init reporter
   reporter_ = Reporter::Create();
   remain = reporter_->Init(remain);
@@ -36,6 +49,7 @@ KWArgs SGDLearner::Init(const KWArgs& kwargs) {
   remain = updater->Init(remain);
   remain.push_back(std::make_pair("V_dim", std::to_string(updater->param().V_dim)));
   remain.push_back(std::make_pair("field_num", std::to_string(updater->param().field_num)));
+  remain.push_back(std::make_pair("V_dims", updater->param().V_dims));
   // init store
   store_ = Store::Create();
   store_->SetUpdater(std::shared_ptr<Updater>(updater));
@@ -44,7 +58,36 @@ KWArgs SGDLearner::Init(const KWArgs& kwargs) {
   // init loss
   loss_ = Loss::Create(param_.loss, blk_nthreads_);
   remain = loss_->Init(remain);
-  
+  // recover from the last checkpoint and the updates since then, before the
+  // periodic checkpoints start
+  if (IsServer() && param_.update_log) {
+    CHECK(param_.model_out.size()) << "update_log needs model_out";
+    CHECK(param_.checkpoint_interval > 0 || param_.checkpoint_batches > 0)
+        << "update_log needs periodic checkpoints";
+    // the log starts from a snapshot of the loaded model, whose writing would
+    // wait for all entries to be loaded
+    CHECK(!param_.lazy_load) << "update_log cannot be used with lazy_load";
+    if (store_->IsRecovery()) {
+      updater->Recover(ModelName(param_.model_out, -1), param_.has_aux);
+    } else {
+      updater->StartUpdateLog(ModelName(param_.model_out, -1));
+    }
+  }
+  // the compression of the pushed gradients
+  const auto& up = updater->param();
+  if (IsWorker() && (up.grad_bits > 0 || up.grad_topk < 1)) {
+    compressor_.Init(updater->dims(), up.grad_bits, up.grad_topk,
+                     up.grad_residual_age, up.seed + store_->Rank());
+  }
+  // periodic checkpoints, which are taken by each server on its own
+  if (IsServer() && param_.model_out.size() &&
+      (param_.checkpoint_interval > 0 || param_.checkpoint_batches > 0)) {
+    CHECK_EQ(param_.model_format, kModelSnapshot)
+        << "periodic checkpoints need model_format=snapshot";
+    updater->SetCheckpoint(ModelName(param_.model_out, -1), param_.has_aux,
+                           param_.num_deltas, param_.checkpoint_interval,
+                           param_.checkpoint_batches);
+  }
   return remain;
 }
 
@@ -53,8 +96,22 @@ void SGDLearner::RunScheduler() {
   int k = 0;
   start_time_ = dmlc::GetTime();
 
-  // load model
-  if (param_.model_in.size()) {
+  // resume from the last checkpoint in the journal, or load model_in
+  std::vector<int> skip;
+  int num_parts = 0;
+  if (param_.journal.size() && ReadJournal(&k, &num_parts, &skip)) {
+    LOG(INFO) << "resume epoch " << k << " with " << skip.size() << " of "
+              << num_parts << " parts finished, from checkpoint " << ckpt_seq_
+              << " of chain " << ckpt_chain_;
+    SaveLoadModel(sgd::Job::kLoadCheckpoint, -1, ckpt_chain_, ckpt_seq_);
+    if (num_parts != store_->NumWorkers() * param_.num_jobs_per_epoch) {
+      LOG(INFO) << "the number of parts is changed, run the whole epoch again";
+      skip.clear();
+    } else if (static_cast<int>(skip.size()) == num_parts) {
+      ++ k;
+      skip.clear();
+    }
+  } else if (param_.model_in.size()) {
     if (param_.load_epoch > 0) {
       LOG(INFO) << "Loading model from epoch " << param_.load_epoch;
       SaveLoadModel(sgd::Job::kLoadModel, param_.load_epoch);
@@ -78,7 +135,8 @@ void SGDLearner::RunScheduler() {
   for (; k < param_.max_num_epochs; ++k) {
     sgd::Progress train_prog;
     LOG(INFO) << "Start epoch " << k;
-    RunEpoch(k, sgd::Job::kTraining, &train_prog);
+    RunEpoch(k, sgd::Job::kTraining, &train_prog, skip);
+    skip.clear();
     LOG(INFO) << "Epoch[" << k << "] Training: " << train_prog.TextString();
 
     sgd::Progress val_prog;
@@ -109,40 +167,81 @@ void SGDLearner::RunScheduler() {
     }
     pre_loss = train_prog.loss;
     pre_val_auc = val_prog.auc;
+    // the final model is saved below, and the servers taking periodic
+    // checkpoints save the others
+    bool periodic = param_.checkpoint_interval > 0 || param_.checkpoint_batches > 0;
+    if ((param_.num_deltas > 0 || param_.journal.size() || param_.checkpoint_parts > 0) &&
+        param_.model_out.size() && !periodic) {
+      LOG(INFO) << "Saving a checkpoint of epoch " << k;
+      SaveCheckpoint(k);
+    }
   }
 
   // Save last model
   if (param_.model_out.size()) {
     LOG(INFO) << "Saving the final model...";
-    SaveLoadModel(sgd::Job::kSaveModel);
+    // it is a full checkpoint of the last epoch trained
+    SaveCheckpoint(k, true);
     LOG(INFO) << "Save model finished";
   }
   Stop();
 }
 
-void SGDLearner::RunEpoch(int epoch, int job_type, sgd::Progress* prog) {
-  // progress merger
+void SGDLearner::RunEpoch(int epoch, int job_type, sgd::Progress* prog,
+                          const std::vector<int>& skip) {
+  int n = store_->NumWorkers() * param_.num_jobs_per_epoch;
+  bool training = job_type == sgd::Job::kTraining;
+  if (training) {
+    std::lock_guard<std::mutex> lk(finished_mu_);
+    num_parts_ = n;
+    finished_ = skip;
+  }
+  // progress merger, a data job returns the progress followed by the job
   tracker_->SetMonitor(
-      [this, prog](int node_id, const std::string& rets) {
-        prog->Merge(rets);
+      [this, prog, training](int node_id, const std::string& rets) {
+        if (rets.size() <= sizeof(sgd::Progress)) {
+          prog->Merge(rets);
+          return;
+        }
+        prog->Merge(rets.substr(0, sizeof(sgd::Progress)));
+        if (!training) return;
+        sgd::Job job; job.ParseFromString(rets.substr(sizeof(sgd::Progress)));
+        // a part reassigned from a straggler may finish twice
+        std::lock_guard<std::mutex> lk(finished_mu_);
+        if (std::find(finished_.begin(), finished_.end(), job.part_idx) == finished_.end()) {
+          finished_.push_back(job.part_idx);
+        }
       });
 
   // progress reporter
   reporter_->SetMonitor(
       [this](int node_id, const std::string& rets) {
-        report_prog_.prog.Merge(rets);
+        report_prog_.Merge(node_id, rets);
       });
 
   // Start Dispatch
-  int n = store_->NumWorkers() * param_.num_jobs_per_epoch;
-  tracker_->StartDispatch(n, job_type, epoch);
+  tracker_->StartDispatch(n, job_type, epoch, skip);
 
   // wait and report
+  size_t last_ckpt = skip.size();
   while (tracker_->NumRemains()) {
     std::this_thread::sleep_for(std::chrono::milliseconds(param_.report_interval * 1000));
+    if (training && param_.checkpoint_parts > 0) {
+      finished_mu_.lock();
+      size_t finished = finished_.size();
+      finished_mu_.unlock();
+      if (finished >= last_ckpt + param_.checkpoint_parts) {
+        LOG(INFO) << "Saving a checkpoint of epoch " << epoch << " with "
+                  << finished << " parts finished";
+        SaveCheckpoint(epoch);
+        last_ckpt = finished;
+      }
+    }
     if (job_type == sgd::Job::kTraining) {
       printf("%5.0lf  %s\n", dmlc::GetTime() - start_time_, report_prog_.PrintStr().c_str());
       fflush(stdout);
+      std::string stats = report_prog_.StatsStr();
+      if (stats.size()) LOG(INFO) << stats;
     }
   }
 }
@@ -163,35 +262,243 @@ void SGDLearner::Process(const std::string& args, std::string* rets) {
       GetUpdater()->Evaluate(&prog);
       break;
     }
-    case Job::kLoadModel: {
-      std::string filename = ModelName(param_.model_in, job.epoch);
-      std::unique_ptr<dmlc::Stream> fi(
-          dmlc::Stream::Create(filename.c_str(), "r"));
-      GetUpdater()->Load(fi.get());
+    case Job::kLoadModel:
+    case Job::kLoadCheckpoint: {
+      if (job.type == Job::kLoadModel) {
+        LoadModel(param_.model_in, job.epoch);
+      } else {
+        LoadModel(param_.model_out, -1, job.chain, job.seq);
+      }
+      // the updates are logged after a checkpoint, so the loaded model is one
+      if (param_.update_log) {
+        GetUpdater()->SaveDelta(ModelName(param_.model_out, -1), param_.has_aux);
+      }
       break;
     }
     case Job::kSaveModel: {
-      std::string filename = ModelName(param_.model_out, job.epoch);
-      std::unique_ptr<dmlc::Stream> fo(
-          dmlc::Stream::Create(filename.c_str(), "w"));
-      GetUpdater()->Save(param_.has_aux, fo.get());
+      GetUpdater()->SaveModel(ModelName(param_.model_out, job.epoch),
+                              param_.model_format, param_.has_aux, job.chain);
+      break;
+    }
+    case Job::kSaveDelta: {
+      GetUpdater()->SaveDelta(ModelName(param_.model_out, job.epoch), param_.has_aux,
+                              job.chain, job.seq);
       break;
     }
   }
   prog.SerializeToString(rets);
+  if (job.type == Job::kTraining || job.type == Job::kValidation ||
+      job.type == Job::kPrediction) {
+    std::string job_str;
+    job.SerializeToString(&job_str);
+    rets->append(job_str);
+  }
+}
+
+void SGDLearner::LoadModel(const std::string& prefix, int iter, uint64_t chain, uint32_t seq) {
+  auto files = ModelShards(prefix, iter);
+  if (static_cast<int>(files.size()) == store_->NumServers()) {
+    // a checkpoint is loaded at once, since its later deltas are skipped
+    if (param_.lazy_load && !chain) {
+      GetUpdater()->LoadLazy(ModelName(prefix, iter));
+    } else {
+      GetUpdater()->LoadModel(ModelName(prefix, iter), 0, SGDUpdater::kBucketKey,
+                              true, chain, seq);
+    }
+  } else {
+    // saved by a different number of servers, so keep the keys of this one
+    CHECK(files.size()) << "no model file " << ModelName(prefix, iter, 0);
+    LOG(INFO) << "reshard the model saved by " << files.size() << " servers";
+    auto range = store_->KeyRange();
+    GetUpdater()->LoadShards(files, range.first, range.second, chain, seq);
+  }
+}
+
+void SGDLearner::Journal(int epoch, const std::vector<int>& parts) {
+  // a line of: epoch num_parts chain seq num_finished finished_parts...
+  std::stringstream ss;
+  ss << epoch << " " << num_parts_ << " " << ckpt_chain_ << " " << ckpt_seq_
+     << " " << parts.size();
+  for (int p : parts) ss << " " << p;
+  ss << "\n";
+  std::string line = ss.str();
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(param_.journal.c_str(), "a"));
+  fo->Write(line.data(), line.size());
 }
 
-void SGDLearner::GetPos(const SArray<int>& len,
+bool SGDLearner::ReadJournal(int* epoch, int* num_parts, std::vector<int>* parts) {
+  std::unique_ptr<dmlc::Stream> fi(
+      dmlc::Stream::Create(param_.journal.c_str(), "r", true));
+  if (!fi) return false;
+  dmlc::istream is(fi.get());
+  std::string line;
+  bool found = false;
+  while (std::getline(is, line)) {
+    // a line may be truncated if the scheduler died while writing it
+    std::stringstream ss(line);
+    int e, n, m, p;
+    uint64_t chain;
+    uint32_t seq;
+    std::vector<int> finished;
+    if (!(ss >> e >> n >> chain >> seq >> m)) continue;
+    while (static_cast<int>(finished.size()) < m && ss >> p) finished.push_back(p);
+    if (static_cast<int>(finished.size()) != m) continue;
+    *epoch = e; *num_parts = n; *parts = finished;
+    ckpt_chain_ = chain; ckpt_seq_ = seq;
+    found = true;
+  }
+  return found;
+}
+
+void SGDLearner::GetPos(const SArray<int>& len, const SArray<real_t>& masks,
                         SArray<int>* V_pos) {
+  const FieldDims& dims = GetUpdater()->dims();
+  int nf = dims.dims().size(), mask_size = dims.mask_size();
   size_t n = len.size();
-  V_pos->resize(n);
+  V_pos->resize(n * nf);
   int* V = V_pos->data();
   int p = 0;
-  for (size_t i = 0; i < n; ++i) {
-    int l = len[i];
-    V[i] = l == 0 ? -1 : p;
+  for (size_t i = 0; i < n; ++i, V += nf) {
+    real_t const* mask = masks.empty() ? nullptr : masks.data() + i * mask_size;
+    for (int f = 0; f < nf; ++f) {
+      bool pulled = len[i] > 0 && (!mask || FieldDims::HasRow(mask, f));
+      V[f] = pulled ? p : -1;
+      if (pulled) p += dims.dim(f);
+    }
+  }
+}
+
+void SGDLearner::SelectRows(const SArray<real_t>& masks, SArray<real_t>* vals,
+                            SArray<int>* lens) {
+  const FieldDims& dims = GetUpdater()->dims();
+  int nf = dims.dims().size(), mask_size = dims.mask_size();
+  int full = dims.size();
+  real_t* v = vals->data();
+  int p = 0, q = 0;
+  for (size_t i = 0; i < lens->size(); ++i) {
+    int l = (*lens)[i];
+    real_t const* mask = masks.data() + i * mask_size;
+    int m = dims.PackedSize(mask) - mask_size;
+    if (l == full && m < full) {
+      // the rows are moved forward in place
+      for (int f = 0; f < nf; ++f) {
+        if (!FieldDims::HasRow(mask, f)) continue;
+        memmove(v + q, v + p + dims.offset(f), dims.dim(f) * sizeof(real_t));
+        q += dims.dim(f);
+      }
+      (*lens)[i] = m;
+    } else {
+      memmove(v + q, v + p, l * sizeof(real_t));
+      q += l;
+    }
     p += l;
   }
+  vals->resize(q);
+}
+
+bool SGDLearner::GetRowMasks(const dmlc::RowBlock<unsigned>& data, size_t num_feas,
+                             SArray<real_t>* masks) {
+  const FieldDims& dims = GetUpdater()->dims();
+  int nf = dims.dims().size(), mask_size = dims.mask_size();
+  if (nf <= 1 || !data.field) return false;
+  std::vector<uint32_t> bits(num_feas * mask_size, 0);
+  std::vector<uint32_t> row(mask_size);
+  std::vector<int> cnt(nf, 0), own(num_feas);
+  for (size_t i = 0; i < data.size; ++i) {
+    std::fill(row.begin(), row.end(), 0);
+    for (size_t j = data.offset[i]; j < data.offset[i+1]; ++j) {
+      int f = data.field[j];
+      row[f / 32] |= 1u << (f % 32);
+      ++ cnt[f];
+    }
+    for (size_t j = data.offset[i]; j < data.offset[i+1]; ++j) {
+      int f = data.field[j];
+      uint32_t* b = bits.data() + data.index[j] * mask_size;
+      // its own field only if another feature of the example has it
+      uint32_t single = cnt[f] == 1 ? 1u << (f % 32) : 0;
+      for (int k = 0; k < mask_size; ++k) {
+        b[k] |= k == f / 32 ? row[k] & ~single : row[k];
+      }
+      own[data.index[j]] = f;
+    }
+    for (size_t j = data.offset[i]; j < data.offset[i+1]; ++j) cnt[data.field[j]] = 0;
+  }
+  // a feature never with others still pulls a row, so that its push is
+  // counted as a step as when pulling all rows
+  for (size_t i = 0; i < num_feas; ++i) {
+    uint32_t* b = bits.data() + i * mask_size;
+    if (std::all_of(b, b + mask_size, [](uint32_t x) { return x == 0; })) {
+      b[own[i] / 32] |= 1u << (own[i] % 32);
+    }
+  }
+  masks->resize(bits.size());
+  memcpy(masks->data(), bits.data(), bits.size() * sizeof(real_t));
+  // the masks and the keys are sent again ahead of the pull
+  size_t rows = 0;
+  for (size_t i = 0; i < num_feas; ++i) {
+    rows += dims.PackedSize(masks->data() + i * mask_size) - mask_size;
+  }
+  size_t extra = num_feas * (mask_size + sizeof(feaid_t) / sizeof(real_t));
+  return rows + extra < num_feas * dims.size();
+}
+
+void SGDLearner::SplitVersions(SArray<real_t>* vals, SArray<int>* lens,
+                               SArray<real_t>* versions) {
+  size_t n = lens->size();
+  versions->resize(n);
+  real_t* v = vals->data();
+  int p = 0, q = 0;
+  for (size_t i = 0; i < n; ++i) {
+    int l = (*lens)[i];
+    if (l == 0) continue;
+    (*versions)[i] = v[p];
+    memmove(v + q, v + p + 1, (l - 1) * sizeof(real_t));
+    p += l; q += l - 1;
+    (*lens)[i] = l - 1;
+  }
+  vals->resize(q);
+}
+
+void SGDLearner::JoinVersions(const SArray<real_t>& grads, const SArray<int>& lens,
+                              const SArray<real_t>& versions,
+                              SArray<real_t>* vals, SArray<int>* vals_lens) {
+  size_t n = lens.size();
+  vals->resize(grads.size() + n);
+  vals_lens->resize(n);
+  int p = 0, q = 0;
+  for (size_t i = 0; i < n; ++i) {
+    int l = lens[i];
+    (*vals_lens)[i] = l == 0 ? 0 : l + 1;
+    if (l == 0) continue;
+    (*vals)[q] = versions[i];
+    memcpy(vals->data() + q + 1, grads.data() + p, l * sizeof(real_t));
+    p += l; q += l + 1;
+  }
+  vals->resize(q);
+}
+
+bool SGDLearner::PackRows(const SArray<real_t>& grads, const SArray<int>& lens,
+                          const SArray<real_t>& masks,
+                          SArray<real_t>* rows, SArray<int>* rows_lens) {
+  const FieldDims& dims = GetUpdater()->dims();
+  int mask_size = dims.mask_size();
+  size_t n = lens.size();
+  rows->resize(grads.size() + n * dims.mask_size());
+  rows_lens->resize(n);
+  int p = 0, q = 0;
+  for (size_t i = 0; i < n; ++i) {
+    int l = lens[i];
+    (*rows_lens)[i] = 0;
+    if (l == 0) continue;
+    real_t const* mask = masks.empty() ? nullptr : masks.data() + i * mask_size;
+    CHECK_EQ(l, mask ? dims.PackedSize(mask) - mask_size : dims.size());
+    // a feature without non-zero rows is kept, its step still counts
+    int m = dims.PackRows(grads.data() + p, rows->data() + q, mask);
+    (*rows_lens)[i] = m;
+    p += l; q += m;
+  }
+  rows->resize(q);
+  return rows->size() < grads.size();
 }
 
 void SGDLearner::IterateData(const sgd::Job& job, sgd::Progress* progress) {
@@ -207,9 +514,16 @@ void SGDLearner::IterateData(const sgd::Job& job, sgd::Progress* progress) {
           // eval loss
           auto data = batch.data.GetBlock();
           progress->nrows += data.size;
+          // the versions of the weights, which are pushed back with the gradients
+          bool versioned = GetUpdater()->param().staleness_aware;
+          bool compress = GetUpdater()->param().grad_bits > 0 ||
+                          GetUpdater()->param().grad_topk < 1;
+          SArray<real_t> versions;
+          if (versioned) SplitVersions(values, lengths, &versions);
+          if (batch.masks.size()) SelectRows(batch.masks, values, lengths);
           SArray<real_t> pred(data.size);
           SArray<int> V_pos;
-          GetPos(*lengths, &V_pos);
+          GetPos(*lengths, batch.masks, &V_pos);
           std::vector<SArray<char>> inputs = {SArray<char>(*values), SArray<char>(V_pos)};
           CHECK_NOTNULL(loss_)->Predict(data, inputs, &pred);
           auto loss = loss_->Evaluate(batch.data.label.data(), pred);
@@ -230,18 +544,50 @@ void SGDLearner::IterateData(const sgd::Job& job, sgd::Progress* progress) {
             sgd::Progress report_prog; std::string rets;
             report_prog.nrows = data.size;
             report_prog.loss = loss; report_prog.auc = auc;
+            if (compress) {
+              // of the pushes since the last report
+              compressor_.TakeStats(&report_prog.grad_raw, &report_prog.grad_sent,
+                                    &report_prog.residual);
+              report_prog.num_pushes = num_pushes_.exchange(0);
+            }
             report_prog.SerializeToString(&rets);
             reporter_->Report(rets);
 
             SArray<real_t> grads(values->size());
             inputs.push_back(SArray<char>(pred));
             loss_->CalcGrad(data, inputs, &grads);
+            if (compress) compressor_.AddResidual(batch.feaids, V_pos, &grads);
+            SArray<int> grad_lens = *lengths;
+            // only the rows of the fields co-occurring with a feature in this
+            // batch are non-zero
+            int grad_type = Store::kGradient;
+            SArray<real_t> rows;
+            SArray<int> rows_lens;
+            // the rows pulled by masks can only be pushed packed
+            if (PackRows(grads, *lengths, batch.masks, &rows, &rows_lens) ||
+                batch.masks.size() || compress) {
+              grad_type = Store::kGradientRows;
+              grads = rows;
+              grad_lens = rows_lens;
+            }
+            if (compress) {
+              compressor_.Compress(batch.feaids, &grads, &grad_lens);
+              if (GetUpdater()->param().grad_bits) grad_type = Store::kGradientCodes;
+              ++ num_pushes_;
+            }
+            if (versioned) {
+              SArray<real_t> vals;
+              SArray<int> vals_lens;
+              JoinVersions(grads, grad_lens, versions, &vals, &vals_lens);
+              grads = vals;
+              grad_lens = vals_lens;
+            }
 
             // push the gradient, this task is done only if the push is complete
             store_->Push(batch.feaids,
-                         Store::kGradient,
+                         grad_type,
                          grads,
-                         *lengths,
+                         grad_lens,
                          [this, on_complete]() { on_complete(); });
           } else {
             // a validation/prediction job
@@ -251,7 +597,12 @@ void SGDLearner::IterateData(const sgd::Job& job, sgd::Progress* progress) {
           if (lengths) delete lengths;
         };
         // pull the weight back
-        store_->Pull(batch.feaids, Store::kWeight, values, lengths, pull_callback);
+        if (batch.masks.size()) {
+          store_->PullRows(batch.feaids, Store::kWeight, batch.masks,
+                           values, lengths, pull_callback);
+        } else {
+          store_->Pull(batch.feaids, Store::kWeight, values, lengths, pull_callback);
+        }
       });
 
   Reader* reader = nullptr;
@@ -286,6 +637,10 @@ void SGDLearner::IterateData(const sgd::Job& job, sgd::Progress* progress) {
     batch.feaids = SArray<feaid_t>(feaids);
     batch.data = SharedRowBlockContainer<unsigned>(&data);
     delete data;
+    // pull only the field rows the examples use
+    if (!GetRowMasks(batch.data.GetBlock(), batch.feaids.size(), &batch.masks)) {
+      batch.masks.clear();
+    }
 
     // push feature count into the servers
     if (push_cnt) {
@@ -4,7 +4,11 @@
 #ifndef DIFACTO_SGD_SGD_LEARNER_H_
 #define DIFACTO_SGD_SGD_LEARNER_H_
 #include <string>
+#include <memory>
 #include <vector>
+#include <mutex>
+#include <atomic>
+#include "dmlc/timer.h"
 #include "difacto/learner.h"
 #include "difacto/loss.h"
 #include "difacto/store.h"
@@ -50,21 +54,79 @@ class SGDLearner : public Learner {
   void Process(const std::string& args, std::string* rets);
 
  private:
-  void RunEpoch(int epoch, int job_type, sgd::Progress* prog);
+  /** \brief run the parts of an epoch except for the ones in skip */
+  void RunEpoch(int epoch, int job_type, sgd::Progress* prog,
+                const std::vector<int>& skip = {});
 
-  /** \brief save or load model */
-  inline void SaveLoadModel(int type, int iter = -1) {
+  /** \brief save or load model, chain and seq are the ones of a checkpoint */
+  inline void SaveLoadModel(int type, int iter = -1, uint64_t chain = 0, uint32_t seq = 0) {
     sgd::Job job; std::string job_str;
     job.type = type; job.epoch = iter;
+    job.chain = chain; job.seq = seq;
     job.SerializeToString(&job_str);
     tracker_->IssueAndWait(NodeID::kServerGroup, job_str);
   }
 
-  /** \brief get the saved model name only for servers */
-  inline std::string ModelName(const std::string& prefix, int iter) {
+  /**
+   * \brief save a checkpoint into model_out, which is a full snapshot every
+   * num_deltas + 1 checkpoints, or if full, and a delta otherwise. the
+   * scheduler picks its chain and seq for all servers. it is journaled with
+   * the training parts of epoch finished before it started
+   */
+  inline void SaveCheckpoint(int epoch, bool full = false) {
+    std::vector<int> parts;
+    {
+      std::lock_guard<std::mutex> lk(finished_mu_);
+      parts = finished_;
+    }
+    full = full || ckpt_chain_ == 0 || static_cast<int>(ckpt_seq_) >= param_.num_deltas;
+    if (full) {
+      ckpt_chain_ = static_cast<uint64_t>(dmlc::GetTime() * 1e6);
+      ckpt_seq_ = 0;
+    } else {
+      ++ ckpt_seq_;
+    }
+    SaveLoadModel(full ? sgd::Job::kSaveModel : sgd::Job::kSaveDelta, -1,
+                  ckpt_chain_, ckpt_seq_);
+    if (param_.journal.size() && num_parts_ > 0) Journal(epoch, parts);
+  }
+
+  /** \brief append a checkpoint with the finished parts of epoch into the journal */
+  void Journal(int epoch, const std::vector<int>& parts);
+
+  /**
+   * \brief read the last checkpoint in the journal, returns false if none. it
+   * sets ckpt_chain_ and ckpt_seq_ to the ones of it
+   */
+  bool ReadJournal(int* epoch, int* num_parts, std::vector<int>* parts);
+
+  /**
+   * \brief load the model saved by all servers, resharded if needed. chain and
+   * seq are the ones of a checkpoint, see SGDUpdater::LoadModel
+   */
+  void LoadModel(const std::string& prefix, int iter, uint64_t chain = 0, uint32_t seq = 0);
+
+  /**
+   * \brief get the saved model name only for servers
+   * @param part the rank of the server which saved it, this one if -1
+   */
+  inline std::string ModelName(const std::string& prefix, int iter, int part = -1) {
     std::string name = prefix;
     if (iter >= 0) name += "_iter-" + std::to_string(iter);
-    return name + "_part-" + std::to_string(store_->Rank());
+    if (part < 0) part = store_->Rank();
+    return name + "_part-" + std::to_string(part);
+  }
+
+  /** \brief the model files saved by all servers, whose ranks are 0, 1, ... */
+  inline std::vector<std::string> ModelShards(const std::string& prefix, int iter) {
+    std::vector<std::string> files;
+    while (true) {
+      std::string name = ModelName(prefix, iter, files.size());
+      std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(name.c_str(), "r", true));
+      if (!fi) break;
+      files.push_back(name);
+    }
+    return files;
   }
 
   /** \brief save prediction to files only for workers */
@@ -104,7 +166,47 @@ class SGDLearner : public Learner {
    */
   void IterateData(const sgd::Job& job, sgd::Progress* prog);
 
-  void GetPos(const SArray<int>& len, SArray<int>* V_pos);
+  /**
+   * \brief the positions of the field rows of the pulled weights, -1 if a row
+   * is not pulled, see \ref FFMLoss::Predict
+   * @param masks the row masks the weights are pulled by, empty if all rows
+   */
+  void GetPos(const SArray<int>& len, const SArray<real_t>& masks, SArray<int>* V_pos);
+
+  /**
+   * \brief keep only the rows in the masks of the features pulled with all
+   * rows, which a server returns if it lost the masks of the pull
+   */
+  void SelectRows(const SArray<real_t>& masks, SArray<real_t>* vals, SArray<int>* lens);
+
+  /**
+   * \brief the row masks of the field rows the features of a localized batch
+   * need, which are the fields of the other features in the same examples.
+   * returns whether pulling only these rows is smaller than all rows
+   */
+  bool GetRowMasks(const dmlc::RowBlock<unsigned>& data, size_t num_feas,
+                   SArray<real_t>* masks);
+
+  /**
+   * \brief move the versions in front of the pulled weights into versions,
+   * see SGDUpdaterParam::staleness_aware
+   */
+  void SplitVersions(SArray<real_t>* vals, SArray<int>* lens,
+                     SArray<real_t>* versions);
+
+  /** \brief put the versions back in front of the gradients */
+  void JoinVersions(const SArray<real_t>& grads, const SArray<int>& lens,
+                    const SArray<real_t>& versions,
+                    SArray<real_t>* vals, SArray<int>* vals_lens);
+
+  /**
+   * \brief keep only the non-zero field rows of the gradients, led by their
+   * row masks, see \ref FieldDims::PackRows. returns whether it is smaller
+   * @param masks the row masks the weights were pulled by, empty if all rows
+   */
+  bool PackRows(const SArray<real_t>& grads, const SArray<int>& lens,
+                const SArray<real_t>& masks,
+                SArray<real_t>* rows, SArray<int>* rows_lens);
 
   /** \brief the model store*/
   Store* store_;
@@ -118,6 +220,17 @@ class SGDLearner : public Learner {
   sgd::Report_prog report_prog_;
   int blk_nthreads_ = DEFAULT_NTHREADS;
   double start_time_;
+  /** \brief the chain and the seq of the last checkpoint, see \ref SaveCheckpoint */
+  uint64_t ckpt_chain_ = 0;
+  uint32_t ckpt_seq_ = 0;
+  /** \brief the parts of the training epoch running and the finished ones */
+  int num_parts_ = 0;
+  std::vector<int> finished_;
+  std::mutex finished_mu_;
+  /** \brief the compression of the pushed gradients, see SGDUpdaterParam::grad_bits */
+  GradCompressor compressor_;
+  /** \brief the number of compressed pushes since the last report */
+  std::atomic<int> num_pushes_{0};
 
   std::vector<std::function<void(int epoch, const sgd::Progress& train,
                                  const sgd::Progress& val)>> epoch_end_callback_;
@@ -6,6 +6,30 @@
 #include <string>
 #include "dmlc/parameter.h"
 namespace difacto {
+/** \brief the format of a saved model */
+enum SGDModelFormat {
+  /** \brief a stream of (key, entry), which can be saved anywhere */
+  kModelStream = 0,
+  /** \brief a local columnar file which can be mapped, see \ref SGDSnapshot */
+  kModelSnapshot = 1,
+  /**
+   * \brief a stream of blocks, whose keys are delta-varint encoded and values
+   * are lz4 compressed, see \ref SGDModelCodec
+   */
+  kModelCompressed = 2,
+  /** \brief kModelCompressed with V quantized into 8 bits, which is lossy */
+  kModelCompressedInt8 = 3,
+};
+
+/** \brief how the values of a block of a compressed model are encoded */
+enum SGDModelCodec {
+  kCodecNone = 0,
+  /** \brief lz4 */
+  kCodecLZ4 = 1,
+  /** \brief lz4, with V quantized into a scale and 8-bit integers per entry */
+  kCodecLZ4Int8 = 2,
+};
+
 /**
  * \brief sgd config
  */
@@ -51,6 +75,54 @@ struct SGDLearnerParam : public dmlc::Parameter<SGDLearnerParam> {
   real_t stop_val_auc;
   /** \brief wether has aux info */
   bool has_aux;
+  /**
+   * \brief the format model_out is saved in, see \ref SGDModelFormat. the
+   * format of model_in is detected
+   */
+  int model_format;
+  /**
+   * \brief if > 0, a checkpoint is saved after each epoch, and the ones
+   * between two full snapshots are num_deltas deltas with only the changed
+   * entries. it needs the snapshot format. with periodic checkpoints, it is
+   * the number of deltas of each server instead
+   */
+  int num_deltas;
+  /**
+   * \brief if > 0, each server saves a checkpoint into model_out in the
+   * background every checkpoint_interval minutes. the chain of these is kept
+   * by each server, so they cannot be used with journal or checkpoint_parts,
+   * whose chain is kept by the scheduler
+   */
+  int checkpoint_interval;
+  /** \brief if > 0, a server saves a checkpoint every n gradient pushes */
+  int checkpoint_batches;
+  /**
+   * \brief the local file the scheduler journals the checkpoints into, each
+   * with its chain and seq, and the training parts of its epoch finished
+   * before it. a run restarted with the same journal loads the last
+   * checkpoint and runs only the unfinished parts of its epoch. it needs
+   * model_out
+   */
+  std::string journal;
+  /**
+   * \brief if > 0, the scheduler also saves a checkpoint every n training
+   * parts finished, see \ref journal
+   */
+  int checkpoint_parts;
+  /**
+   * \brief if true, a server starts serving once the snapshot of model_in is
+   * opened, and loads an entry on its first access while loading the others
+   * in the background
+   */
+  bool lazy_load;
+  /**
+   * \brief if true, each server logs the updates since its last checkpoint
+   * next to model_out, and a server restarted by ps-lite recovers from them.
+   * it needs periodic checkpoints in the snapshot format. the requests to the
+   * dead server are retried by ps-lite with PS_RESEND=1. it cannot be used
+   * with lazy_load
+   */
+  bool update_log;
   /** \brief task only for prediction */
   int task;
   DMLC_DECLARE_PARAMETER(SGDLearnerParam) {
@@ -72,10 +144,65 @@ struct SGDLearnerParam : public dmlc::Parameter<SGDLearnerParam> {
     DMLC_DECLARE_FIELD(stop_rel_objv).set_default(1e-6);
     DMLC_DECLARE_FIELD(stop_val_auc).set_default(1e-5);
     DMLC_DECLARE_FIELD(has_aux).set_default(false);
+    DMLC_DECLARE_FIELD(model_format).set_default(kModelStream)
+        .add_enum("stream", kModelStream)
+        .add_enum("snapshot", kModelSnapshot)
+        .add_enum("compressed", kModelCompressed)
+        .add_enum("compressed_int8", kModelCompressedInt8);
+    DMLC_DECLARE_FIELD(num_deltas).set_default(0);
+    DMLC_DECLARE_FIELD(checkpoint_interval).set_default(0);
+    DMLC_DECLARE_FIELD(checkpoint_batches).set_default(0);
+    DMLC_DECLARE_FIELD(lazy_load).set_default(false);
+    DMLC_DECLARE_FIELD(journal).set_default("");
+    DMLC_DECLARE_FIELD(checkpoint_parts).set_default(0);
+    DMLC_DECLARE_FIELD(update_log).set_default(false);
     DMLC_DECLARE_FIELD(task).set_default(0);
   }
 };
 
+/**
+ * \brief the optimizer used to update V
+ */
+enum SGDOptimizer {
+  /** \brief adagrad with one accumulator per element of V */
+  kAdaGrad = 0,
+  /** \brief adagrad with one accumulator per (feature, field) row of V */
+  kRowAdaGrad = 1,
+  /** \brief FTRL-proximal, which produces exact zeros with the l1 regularizer */
+  kFTRL = 2,
+};
+
+/**
+ * \brief which entries to evict once the memory budget is reached
+ */
+enum SGDEvictPolicy {
+  /** \brief least frequently updated first, the counts are halved per eviction */
+  kEvictLFU = 0,
+  /** \brief entries not updated for evict_ttl seconds, then least recently updated */
+  kEvictTTL = 1,
+};
+
+/**
+ * \brief the precision V and the optimizer state are stored in
+ */
+enum SGDPrecision {
+  kFP32 = 0,
+  /** \brief ieee half, with a 10-bit mantissa and a range up to 65504 */
+  kFP16 = 1,
+  /** \brief the upper 16 bits of fp32, with a 7-bit mantissa and the fp32 range */
+  kBF16 = 2,
+};
+
+/**
+ * \brief the table holding the entries of a server
+ */
+enum SGDTableType {
+  /** \brief a node-based hash table */
+  kHashTable = 0,
+  /** \brief sorted arrays, looked up by merge joins against the sorted keys */
+  kSortedTable = 1,
+};
+
 struct SGDUpdaterParam : public dmlc::Parameter<SGDUpdaterParam> {
   /** \brief the l1 regularizer for :math:`w`: :math:`\lambda_1 |w|_1` */
   float l1;
@@ -98,14 +225,98 @@ struct SGDUpdaterParam : public dmlc::Parameter<SGDUpdaterParam> {
    *   [-V_init_scale, +V_init_scale]
    */
   float V_init_scale;
-  /** \brief the minimal feature count for allocating V */
+  /**
+   * \brief the minimal feature count for allocating V
+   *
+   * if positive, the counts are kept by a count-min sketch so that no entry
+   * is created before a feature is admitted
+   */
   int V_threshold;
+  /**
+   * \brief the minimal feature count for a private V. if positive, features
+   * counted less share num_buckets hashed entries
+   */
+  int tier_threshold;
+  /** \brief the number of buckets shared by the tail features */
+  int num_buckets;
+  /** \brief the number of counters per row of the admission sketch */
+  int admit_sketch_width;
+  /** \brief the number of rows (hash functions) of the admission sketch */
+  int admit_sketch_depth;
+  /** \brief the factor to decay the admission counts by */
+  float admit_decay;
+  /** \brief decay the admission counts for every n feature count pushes */
+  int admit_decay_interval;
   /** \brief the embedding dimension */
   int V_dim;
   /** \brief the num of fields */
   int field_num;
+  /**
+   * \brief the embedding dimensions of the fields separated by commas, such
+   * as "8,8,2". if empty, all fields use V_dim
+   */
+  std::string V_dims;
   /** \brief random seed */
   unsigned int seed;
+  /** \brief the optimizer for V, see \ref SGDOptimizer */
+  int optimizer;
+  /** \brief the memory budget of a server in MB, 0 means unbounded */
+  int max_mem;
+  /** \brief the eviction policy, see \ref SGDEvictPolicy */
+  int evict_policy;
+  /** \brief the time to live of an entry in seconds for the ttl policy */
+  int evict_ttl;
+  /** \brief check the memory budget for every n seconds */
+  int evict_interval;
+  /**
+   * \brief the local file prefix of the cold tier. if given, evicted entries
+   * are moved into this file instead of being dropped
+   */
+  std::string cold_path;
+  /**
+   * \brief the storage precision of V, see \ref SGDPrecision. the computation
+   * is always in fp32, and the results are stochastically rounded back
+   */
+  int V_precision;
+  /**
+   * \brief the storage precision of the optimizer state, fp32 or bf16. fp16
+   * is rejected, as the accumulated squared gradients of adagrad overflow
+   * its range of 65504
+   */
+  int state_precision;
+  /** \brief the table of the entries, see \ref SGDTableType */
+  int table;
+  /**
+   * \brief whether to scale the step of a gradient by its staleness. a pull
+   * returns the version of each entry, namely its number of updates, and the
+   * worker pushes it back with the gradient. the learning rate is then
+   * divided by 1 + the number of updates applied in between
+   */
+  bool staleness_aware;
+  /** \brief send the statistics of a server every n seconds, 0 means never */
+  int stats_interval;
+  /**
+   * \brief the number of the most pushed keys in the statistics, which are
+   * found by a space-saving sketch with 16x counters. 0 means no sketch
+   */
+  int num_hot_keys;
+  /** \brief the number of threads to save and load a snapshot */
+  int num_threads;
+  /**
+   * \brief quantize the rows of the pushed gradients into 8 or 4 bits per
+   * element with a scale per row, 0 to push fp32. see \ref GradCompressor
+   */
+  int grad_bits;
+  /**
+   * \brief the fraction of the non-zero rows of a push to send, the ones of
+   * the largest norms. the rest waits in the residuals of the worker
+   */
+  float grad_topk;
+  /**
+   * \brief the number of pushes of a worker after which the residual of a
+   * feature not pushed again is dropped, 0 to keep it
+   */
+  int grad_residual_age;
   DMLC_DECLARE_PARAMETER(SGDUpdaterParam) {
     DMLC_DECLARE_FIELD(l1).set_range(0, 1e10).set_default(1);
     DMLC_DECLARE_FIELD(l2).set_range(0, 1e10).set_default(0);
@@ -116,9 +327,46 @@ struct SGDUpdaterParam : public dmlc::Parameter<SGDUpdaterParam> {
     DMLC_DECLARE_FIELD(V_lr_beta).set_range(0, 10).set_default(1);
     DMLC_DECLARE_FIELD(V_init_scale).set_range(0, 10).set_default(1.0);
     DMLC_DECLARE_FIELD(V_threshold).set_default(0);
+    DMLC_DECLARE_FIELD(tier_threshold).set_default(0);
+    DMLC_DECLARE_FIELD(num_buckets).set_range(1, 1 << 30).set_default(1 << 16);
+    DMLC_DECLARE_FIELD(admit_sketch_width).set_range(1, 1 << 30).set_default(1 << 20);
+    DMLC_DECLARE_FIELD(admit_sketch_depth).set_range(1, 16).set_default(4);
+    DMLC_DECLARE_FIELD(admit_decay).set_range(0, 1).set_default(1);
+    DMLC_DECLARE_FIELD(admit_decay_interval).set_range(1, 1 << 30).set_default(1000);
     DMLC_DECLARE_FIELD(V_dim).set_range(1, 10000).set_default(4);
     DMLC_DECLARE_FIELD(field_num).set_range(0, 10000).set_default(0);
+    DMLC_DECLARE_FIELD(V_dims).set_default("");
     DMLC_DECLARE_FIELD(seed).set_default(0);
+    DMLC_DECLARE_FIELD(optimizer).set_default(kAdaGrad)
+        .add_enum("adagrad", kAdaGrad)
+        .add_enum("rowwise_adagrad", kRowAdaGrad)
+        .add_enum("ftrl", kFTRL)
+        .describe("The optimizer used to update V");
+    DMLC_DECLARE_FIELD(max_mem).set_range(0, 1 << 30).set_default(0);
+    DMLC_DECLARE_FIELD(evict_policy).set_default(kEvictLFU)
+        .add_enum("lfu", kEvictLFU)
+        .add_enum("ttl", kEvictTTL);
+    DMLC_DECLARE_FIELD(evict_ttl).set_range(1, 1 << 30).set_default(3600);
+    DMLC_DECLARE_FIELD(evict_interval).set_range(1, 1 << 20).set_default(10);
+    DMLC_DECLARE_FIELD(cold_path).set_default("");
+    DMLC_DECLARE_FIELD(V_precision).set_default(kFP32)
+        .add_enum("fp32", kFP32)
+        .add_enum("fp16", kFP16)
+        .add_enum("bf16", kBF16);
+    DMLC_DECLARE_FIELD(state_precision).set_default(kFP32)
+        .add_enum("fp32", kFP32)
+        .add_enum("fp16", kFP16)
+        .add_enum("bf16", kBF16);
+    DMLC_DECLARE_FIELD(table).set_default(kHashTable)
+        .add_enum("hash", kHashTable)
+        .add_enum("sorted", kSortedTable);
+    DMLC_DECLARE_FIELD(staleness_aware).set_default(false);
+    DMLC_DECLARE_FIELD(stats_interval).set_range(0, 1 << 30).set_default(60);
+    DMLC_DECLARE_FIELD(num_hot_keys).set_range(0, 1 << 20).set_default(0);
+    DMLC_DECLARE_FIELD(num_threads).set_range(1, 256).set_default(8);
+    DMLC_DECLARE_FIELD(grad_bits).set_default(0);
+    DMLC_DECLARE_FIELD(grad_topk).set_range(0, 1).set_default(1);
+    DMLC_DECLARE_FIELD(grad_residual_age).set_range(0, 1 << 30).set_default(1000);
   }
 };
 }  // namespace difacto
@@ -0,0 +1,238 @@
+/**
+ * Copyright (c) 2016 by Contributors
+ * @file   sgd_snapshot.h
+ * @brief  a flat columnar model file which can be memory mapped
+ */
+#ifndef DIFACTO_SGD_SGD_SNAPSHOT_H_
+#define DIFACTO_SGD_SGD_SNAPSHOT_H_
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "dmlc/io.h"
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+namespace difacto {
+
+/**
+ * \brief the header of a snapshot
+ *
+ * a snapshot is the header, the dims of the fields, and then three sections,
+ * the entries, the shared buckets, and the erased keys. a section is a sorted
+ * key array, a block of V with a fixed stride per key, and an optional block
+ * of the state. all blocks start at a page boundary, so that the file can be
+ * mapped and read in place.
+ *
+ * a full snapshot starts a chain, which is followed by deltas with seq = 1,
+ * 2, ... a delta holds the entries changed since the previous file of the
+ * chain, and the keys erased since then, which only have the key array.
+ */
+struct SGDSnapshotHeader {
+  static const uint32_t kMagic = 0x4e534644;
+  /** \brief a sorted key array with its V and state blocks */
+  struct Section {
+    uint64_t num = 0;
+    uint64_t keys_offset = 0;
+    uint64_t V_offset = 0;
+    uint64_t state_offset = 0;
+  };
+  uint32_t magic = kMagic;
+  /** \brief whether the state is saved */
+  int32_t has_aux = 0;
+  int32_t optimizer = 0;
+  int32_t field_num = 0;
+  int32_t V_precision = 0;
+  int32_t state_precision = 0;
+  /** \brief the number of buckets of the updater which saved it */
+  int32_t num_buckets = 0;
+  /** \brief the bytes of V and of the state of a key */
+  uint32_t V_stride = 0;
+  uint32_t state_stride = 0;
+  /** \brief the position in the chain, 0 for a full snapshot */
+  uint32_t seq = 0;
+  /** \brief the id of the chain, which is set by the full snapshot */
+  uint64_t chain = 0;
+  Section entries;
+  Section buckets;
+  Section erased;
+  /** \brief the size of the file */
+  uint64_t file_size = 0;
+
+  /**
+   * \brief place the sections of n entries, m buckets and t erased keys after
+   * the dims
+   */
+  void Layout(uint64_t n, uint64_t m, uint64_t t = 0) {
+    uint64_t off = Align(sizeof(SGDSnapshotHeader) + sizeof(int32_t) * field_num);
+    auto place = [&](uint64_t num, Section* sec) {
+      sec->num = num;
+      sec->keys_offset = off; off = Align(off + num * sizeof(feaid_t));
+      sec->V_offset = off; off = Align(off + num * V_stride);
+      sec->state_offset = off; off = Align(off + num * state_stride);
+    };
+    place(n, &entries);
+    place(m, &buckets);
+    erased.num = t;
+    erased.keys_offset = off;
+    off = Align(off + t * sizeof(feaid_t));
+    file_size = off;
+  }
+  static uint64_t Align(uint64_t off) {
+    const uint64_t page = 4096;
+    return (off + page - 1) / page * page;
+  }
+};
+
+/**
+ * \brief a snapshot mapped into memory
+ *
+ * it is either created for writing by \ref Create, or mapped read-only by
+ * \ref Open, for which the pages are loaded on demand, so a predictor or a
+ * server starts without reading the whole file
+ */
+class SGDSnapshot {
+ public:
+  SGDSnapshot() { }
+  ~SGDSnapshot() { Close(); }
+
+  /** \brief whether a file is a snapshot, only local files can be */
+  static bool Is(const std::string& filename) {
+    SGDSnapshotHeader header;
+    return ReadHeader(filename, &header);
+  }
+
+  /** \brief read the header of a file, returns false if not a snapshot */
+  static bool ReadHeader(const std::string& filename, SGDSnapshotHeader* header) {
+    std::unique_ptr<dmlc::Stream> fi(
+        dmlc::Stream::Create(filename.c_str(), "r", true));
+    if (!fi) return false;
+    size_t n = fi->Read(header, sizeof(*header));
+    if (n < sizeof(header->magic)) return false;
+    return header->magic == SGDSnapshotHeader::kMagic;
+  }
+
+  /** \brief map a snapshot read-only */
+  void Open(const std::string& filename) {
+    Close();
+    int fd = open(LocalPath(filename).c_str(), O_RDONLY);
+    CHECK_GE(fd, 0) << "failed to open " << filename;
+    struct stat st;
+    CHECK_EQ(fstat(fd, &st), 0);
+    size_ = st.st_size;
+    CHECK_GE(size_, sizeof(SGDSnapshotHeader)) << filename << " is not a snapshot";
+    void* p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(p != MAP_FAILED) << "failed to map " << filename;
+    base_ = static_cast<char*>(p);
+    memcpy(&header_, base_, sizeof(header_));
+    CHECK_EQ(header_.magic, SGDSnapshotHeader::kMagic) << filename << " is not a snapshot";
+    CHECK_EQ(header_.file_size, size_) << filename << " is truncated";
+    ReadDims();
+  }
+
+  /** \brief remove a file if exists */
+  static void Remove(const std::string& filename) {
+    unlink(LocalPath(filename).c_str());
+  }
+
+  /**
+   * \brief create a snapshot for writing, whose header and dims are written.
+   * header should have been laid out by SGDSnapshotHeader::Layout. it is
+   * written into a temporary file, which replaces filename on \ref Close, so
+   * a crash never leaves a partial snapshot
+   */
+  void Create(const std::string& filename, const SGDSnapshotHeader& header,
+              const std::vector<int>& dims) {
+    Close();
+    path_ = LocalPath(filename);
+    std::string path = path_ + ".tmp";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK_GE(fd, 0) << "failed to open " << filename;
+    size_ = header.file_size;
+    CHECK_EQ(ftruncate(fd, size_), 0) << "failed to allocate " << filename;
+    void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(p != MAP_FAILED) << "failed to map " << filename;
+    base_ = static_cast<char*>(p);
+    writable_ = true;
+    header_ = header;
+    memcpy(base_, &header_, sizeof(header_));
+    CHECK_EQ(dims.size(), static_cast<size_t>(header_.field_num));
+    for (int f = 0; f < header_.field_num; ++f) {
+      int32_t d = dims[f];
+      memcpy(base_ + sizeof(header_) + f * sizeof(d), &d, sizeof(d));
+    }
+    ReadDims();
+  }
+
+  /** \brief unmap, the changes of a created snapshot are flushed first */
+  void Close() {
+    if (!base_) return;
+    if (writable_) CHECK_EQ(msync(base_, size_, MS_SYNC), 0);
+    munmap(base_, size_);
+    if (writable_) {
+      CHECK_EQ(rename((path_ + ".tmp").c_str(), path_.c_str()), 0)
+          << "failed to write " << path_;
+    }
+    base_ = nullptr; size_ = 0; writable_ = false;
+  }
+
+  const SGDSnapshotHeader& header() const { return header_; }
+  const std::vector<int>& dims() const { return dims_; }
+
+  /** \brief the keys of a section, which are sorted */
+  feaid_t* keys(const SGDSnapshotHeader::Section& sec) const {
+    return reinterpret_cast<feaid_t*>(base_ + sec.keys_offset);
+  }
+  /** \brief V of the i-th key of a section */
+  char* V(const SGDSnapshotHeader::Section& sec, size_t i) const {
+    return base_ + sec.V_offset + i * header_.V_stride;
+  }
+  /** \brief the state of the i-th key of a section, or nullptr if not saved */
+  char* state(const SGDSnapshotHeader::Section& sec, size_t i) const {
+    if (!header_.has_aux) return nullptr;
+    return base_ + sec.state_offset + i * header_.state_stride;
+  }
+  /** \brief the position of a key in a section, or -1 if not found */
+  int64_t Find(const SGDSnapshotHeader::Section& sec, feaid_t key) const {
+    const feaid_t* begin = keys(sec), *end = begin + sec.num;
+    const feaid_t* it = std::lower_bound(begin, end, key);
+    return it != end && *it == key ? it - begin : -1;
+  }
+
+ private:
+  /** \brief mmap needs a local file */
+  static std::string LocalPath(const std::string& filename) {
+    const std::string prefix = "file://";
+    if (filename.compare(0, prefix.size(), prefix) == 0) {
+      return filename.substr(prefix.size());
+    }
+    CHECK(filename.find("://") == std::string::npos)
+        << "a snapshot should be a local file: " << filename;
+    return filename;
+  }
+  void ReadDims() {
+    dims_.resize(header_.field_num);
+    for (int f = 0; f < header_.field_num; ++f) {
+      int32_t d;
+      memcpy(&d, base_ + sizeof(header_) + f * sizeof(d), sizeof(d));
+      dims_[f] = d;
+    }
+  }
+  SGDSnapshotHeader header_;
+  std::vector<int> dims_;
+  char* base_ = nullptr;
+  size_t size_ = 0;
+  bool writable_ = false;
+  /** \brief the local path of a created snapshot */
+  std::string path_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_SNAPSHOT_H_
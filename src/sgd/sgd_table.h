@@ -0,0 +1,289 @@
+/**
+ * Copyright (c) 2016 by Contributors
+ * @file   sgd_table.h
+ * @brief  the entries of a server and the tables holding them
+ */
+#ifndef DIFACTO_SGD_SGD_TABLE_H_
+#define DIFACTO_SGD_SGD_TABLE_H_
+#include <map>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+#include "./sgd_param.h"
+namespace difacto {
+
+/**
+ * \brief the weight entry for one feature
+ *
+ * it owns its arrays, so it is movable but not copyable
+ */
+struct SGDEntry {
+ public:
+  SGDEntry() { }
+  ~SGDEntry() { delete [] V; delete [] Z; delete [] T; }
+  SGDEntry(const SGDEntry&) = delete;
+  SGDEntry& operator=(const SGDEntry&) = delete;
+  SGDEntry(SGDEntry&& e) { *this = std::move(e); }
+  SGDEntry& operator=(SGDEntry&& e) {
+    std::swap(V, e.V); std::swap(Z, e.Z); std::swap(T, e.T);
+    step = e.step; freq = e.freq; touched = e.touched;
+    size = e.size; nnz = e.nnz; stamp = e.stamp;
+    return *this;
+  }
+  /**
+   * \brief V, stored in SGDUpdaterParam::V_precision. nullptr if not
+   * allocated yet, or released, see \ref released
+   */
+  char *V = nullptr;
+  /**
+   * \brief the optimizer state, stored in SGDUpdaterParam::state_precision,
+   * its length is given by SGDUpdater::StateSize
+   */
+  char *Z = nullptr;
+  /**
+   * \brief the step each field row was last written at, only allocated with
+   * lazy l2, see SGDUpdater::DecayRow
+   */
+  uint32_t *T = nullptr;
+  /** \brief the number of updates applied to this entry */
+  uint32_t step = 0;
+  /** \brief the update frequency used by the lfu eviction, halved per eviction */
+  uint32_t freq = 0;
+  /** \brief the time of the last update, in seconds since the updater started */
+  uint32_t touched = 0;
+  /** \brief size of V */
+  int size = 0;
+  int nnz = 0;
+  /**
+   * \brief the number of checkpoints taken before its last change, so it is
+   * changed since the last one if larger than that count, see
+   * SGDUpdater::SaveDelta
+   */
+  uint32_t stamp = 0;
+  /** \brief wether entry is empty */
+  inline bool empty() const { return nnz == 0; }
+  /**
+   * \brief whether V was released for being all zero, while the state is
+   * kept, see SGDUpdater::Release
+   */
+  inline bool released() const { return V == nullptr && Z != nullptr; }
+};
+
+/**
+ * \brief the interface of a table from feature ids to entries
+ *
+ * a returned pointer stays valid until the entry is erased or \ref Maintain
+ * is called. it is not thread-safe, the caller should hold a lock.
+ */
+class SGDTable {
+ public:
+  virtual ~SGDTable() { }
+  /** \brief create a table, see \ref SGDTableType */
+  static SGDTable* Create(int type);
+  /** \brief returns the entry of a key, or nullptr if not exists */
+  virtual SGDEntry* Find(feaid_t key) = 0;
+  /**
+   * \brief find n keys, out[i] is the entry of keys[i] or nullptr. it is
+   * fastest if the keys are sorted
+   */
+  virtual void FindSorted(const feaid_t* keys, size_t n, SGDEntry** out) {
+    for (size_t i = 0; i < n; ++i) out[i] = Find(keys[i]);
+  }
+  /** \brief returns the entry of a key, which is created if not exists */
+  virtual SGDEntry* Insert(feaid_t key) = 0;
+  /**
+   * \brief move n entries with sorted keys into the table, which replace the
+   * existing ones
+   */
+  virtual void InsertSorted(const feaid_t* keys, SGDEntry* vals, size_t n) {
+    for (size_t i = 0; i < n; ++i) *Insert(keys[i]) = std::move(vals[i]);
+  }
+  /** \brief erase a key */
+  virtual void Erase(feaid_t key) = 0;
+  /** \brief the number of entries */
+  virtual size_t size() const = 0;
+  /** \brief call fn(key, entry) on all entries, fn should not insert or erase */
+  virtual void ForEach(const std::function<void(feaid_t, SGDEntry*)>& fn) = 0;
+  void ForEach(const std::function<void(feaid_t, const SGDEntry&)>& fn) const {
+    const_cast<SGDTable*>(this)->ForEach([&fn](feaid_t key, SGDEntry* e) { fn(key, *e); });
+  }
+  /** \brief the memory used per entry by the table itself */
+  virtual size_t EntryOverhead() const = 0;
+  /** \brief the ratio of the entries to the slots of the table */
+  virtual double LoadFactor() const = 0;
+  /** \brief reorganize the table, which is called at the end of a request */
+  virtual void Maintain() { }
+};
+
+/**
+ * \brief a node-based hash table
+ */
+class HashTable : public SGDTable {
+ public:
+  SGDEntry* Find(feaid_t key) override {
+    auto it = map_.find(key);
+    return it == map_.end() ? nullptr : &it->second;
+  }
+  SGDEntry* Insert(feaid_t key) override { return &map_[key]; }
+  void InsertSorted(const feaid_t* keys, SGDEntry* vals, size_t n) override {
+    map_.reserve(map_.size() + n);
+    SGDTable::InsertSorted(keys, vals, n);
+  }
+  void Erase(feaid_t key) override { map_.erase(key); }
+  size_t size() const override { return map_.size(); }
+  void ForEach(const std::function<void(feaid_t, SGDEntry*)>& fn) override {
+    for (auto& it : map_) fn(it.first, &it.second);
+  }
+  size_t EntryOverhead() const override {
+    return sizeof(std::pair<const feaid_t, SGDEntry>) + 2 * sizeof(void*);
+  }
+  double LoadFactor() const override { return map_.load_factor(); }
+
+ private:
+  std::unordered_map<feaid_t, SGDEntry> map_;
+};
+
+/**
+ * \brief a table of sorted arrays
+ *
+ * the entries are kept in a sorted run, so that a request with sorted keys is
+ * a merge join against it with sequential memory access. new keys go into a
+ * small ordered delta, erased keys are marked as dead. the delta and the dead
+ * entries are merged into the run by \ref Maintain once they reach 1/8 of it,
+ * so that the merges are amortized.
+ */
+class SortedTable : public SGDTable {
+ public:
+  SGDEntry* Find(feaid_t key) override {
+    size_t i = std::lower_bound(keys_.begin(), keys_.end(), key) - keys_.begin();
+    if (i < keys_.size() && keys_[i] == key) return dead_[i] ? nullptr : &vals_[i];
+    return FindDelta(key);
+  }
+  void FindSorted(const feaid_t* keys, size_t n, SGDEntry** out) override {
+    size_t N = keys_.size(), lo = 0;
+    for (size_t i = 0; i < n; ++i) {
+      feaid_t key = keys[i];
+      if (i && key < keys[i-1]) lo = 0;
+      // gallop from the last position, then binary search in the last step
+      size_t b = lo, step = 1;
+      while (b < N && keys_[b] < key) { lo = b + 1; b += step; step <<= 1; }
+      lo = std::lower_bound(keys_.begin() + lo, keys_.begin() + std::min(b, N), key)
+           - keys_.begin();
+      if (lo < N && keys_[lo] == key) {
+        out[i] = dead_[lo] ? nullptr : &vals_[lo];
+      } else {
+        out[i] = FindDelta(key);
+      }
+    }
+  }
+  SGDEntry* Insert(feaid_t key) override {
+    size_t i = std::lower_bound(keys_.begin(), keys_.end(), key) - keys_.begin();
+    if (i < keys_.size() && keys_[i] == key) {
+      if (dead_[i]) { dead_[i] = false; -- num_dead_; }
+      return &vals_[i];
+    }
+    return &delta_[key];
+  }
+  void InsertSorted(const feaid_t* keys, SGDEntry* vals, size_t n) override {
+    if (size() != 0 && delta_.size() + num_dead_ + n < MergeThreshold()) {
+      SGDTable::InsertSorted(keys, vals, n);
+    } else {
+      // merged into the run directly rather than through the delta
+      Merge(keys, vals, n);
+    }
+  }
+  void Erase(feaid_t key) override {
+    size_t i = std::lower_bound(keys_.begin(), keys_.end(), key) - keys_.begin();
+    if (i < keys_.size() && keys_[i] == key) {
+      if (dead_[i]) return;
+      vals_[i] = SGDEntry();
+      dead_[i] = true; ++ num_dead_;
+    } else {
+      delta_.erase(key);
+    }
+  }
+  size_t size() const override { return keys_.size() - num_dead_ + delta_.size(); }
+  void ForEach(const std::function<void(feaid_t, SGDEntry*)>& fn) override {
+    for (size_t i = 0; i < keys_.size(); ++i) {
+      if (!dead_[i]) fn(keys_[i], &vals_[i]);
+    }
+    for (auto& it : delta_) fn(it.first, &it.second);
+  }
+  size_t EntryOverhead() const override {
+    return sizeof(feaid_t) + sizeof(SGDEntry) + 1;
+  }
+  /** \brief the fraction of the run and the delta which is alive */
+  double LoadFactor() const override {
+    size_t slots = keys_.size() + delta_.size();
+    return slots ? static_cast<double>(size()) / slots : 1;
+  }
+  void Maintain() override {
+    if (delta_.size() + num_dead_ >= MergeThreshold()) Merge();
+  }
+
+ private:
+  inline SGDEntry* FindDelta(feaid_t key) {
+    if (delta_.empty()) return nullptr;
+    auto it = delta_.find(key);
+    return it == delta_.end() ? nullptr : &it->second;
+  }
+  /** \brief the number of pending changes to merge */
+  inline size_t MergeThreshold() const {
+    size_t threshold = keys_.size() / 8;
+    return threshold < kMinMerge ? kMinMerge : threshold;
+  }
+  /**
+   * \brief merge the delta into the run and drop the dead entries, together
+   * with n sorted entries, which replace the existing ones of the same keys
+   */
+  void Merge(const feaid_t* in_keys = nullptr, SGDEntry* in_vals = nullptr,
+             size_t n = 0) {
+    std::vector<feaid_t> keys; keys.reserve(size() + n);
+    std::vector<SGDEntry> vals; vals.reserve(size() + n);
+    auto it = delta_.begin();
+    size_t i = 0, j = 0;
+    while (i < keys_.size() || it != delta_.end() || j < n) {
+      // the smallest key of the run, the delta and the input
+      bool run = i < keys_.size(), delta = it != delta_.end(), in = j < n;
+      feaid_t key = run ? keys_[i] : delta ? it->first : in_keys[j];
+      if (delta && it->first < key) key = it->first;
+      if (in && in_keys[j] < key) key = in_keys[j];
+      run = run && keys_[i] == key;
+      delta = delta && it->first == key;
+      in = in && in_keys[j] == key;
+      SGDEntry* val = in ? &in_vals[j] : delta ? &it->second :
+                      run && !dead_[i] ? &vals_[i] : nullptr;
+      if (val) {
+        keys.push_back(key);
+        vals.push_back(std::move(*val));
+      }
+      if (run) ++i;
+      if (delta) ++it;
+      if (in) ++j;
+    }
+    keys_.swap(keys);
+    vals_.swap(vals);
+    dead_.assign(keys_.size(), false);
+    delta_.clear();
+    num_dead_ = 0;
+  }
+  /** \brief the minimal number of pending changes to merge */
+  static const size_t kMinMerge = 4096;
+  std::vector<feaid_t> keys_;
+  std::vector<SGDEntry> vals_;
+  std::vector<bool> dead_;
+  size_t num_dead_ = 0;
+  std::map<feaid_t, SGDEntry> delta_;
+};
+
+inline SGDTable* SGDTable::Create(int type) {
+  if (type == kSortedTable) return new SortedTable();
+  return new HashTable();
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_TABLE_H_
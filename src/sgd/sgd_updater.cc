@@ -3,145 +3,1706 @@
  */
 #include <string.h>
 #include "./sgd_updater.h"
+#include "dmlc/timer.h"
 #include "difacto/store.h"
+#include "common/half.h"
+#include "common/hash.h"
+#include "common/parallel_sort.h"
+#include "common/text_format.h"
+#include "./sgd_codec.h"
 namespace difacto {
 
 DMLC_REGISTER_PARAMETER(SGDUpdaterParam);
 
+const feaid_t SGDUpdater::kBucketKey;
+
+namespace {
+/** \brief convert n elements stored in precision prec into real_t */
+void ToFloat(int prec, const char* src, int n, real_t* dst) {
+  auto h = reinterpret_cast<const uint16_t*>(src);
+  if (prec == kFP16) {
+    HalfToFloat(h, n, dst);
+  } else if (prec == kBF16) {
+    BF16ToFloat(h, n, dst);
+  } else {
+    memcpy(dst, src, n * sizeof(real_t));
+  }
+}
+
+/**
+ * \brief convert n real_t into precision prec
+ * @param rng if not null, rounds stochastically
+ */
+void FromFloat(int prec, real_t const* src, int n, char* dst, uint32_t* rng) {
+  auto h = reinterpret_cast<uint16_t*>(dst);
+  if (prec == kFP16) {
+    FloatToHalf(src, n, h, rng);
+  } else if (prec == kBF16) {
+    FloatToBF16(src, n, h, rng);
+  } else {
+    memcpy(dst, src, n * sizeof(real_t));
+  }
+}
+
+/** \brief the version of an entry stored in the bits of a value slot */
+inline real_t VersionToReal(uint32_t version) {
+  real_t r; memcpy(&r, &version, sizeof(r)); return r;
+}
+inline uint32_t RealToVersion(real_t r) {
+  uint32_t version; memcpy(&version, &r, sizeof(r)); return version;
+}
+
+inline int CountNNZ(real_t const* v, int n) {
+  int nnz = 0;
+  for (int i = 0; i < n; ++i) nnz += v[i] != 0;
+  return nnz;
+}
+
+/** \brief the header describing how the entries of a snapshot are saved */
+SGDModelHeader ModelHeader(const SGDSnapshot& snap) {
+  const SGDSnapshotHeader& sh = snap.header();
+  SGDModelHeader header;
+  header.has_aux = sh.has_aux;
+  header.optimizer = sh.optimizer;
+  header.field_num = sh.field_num;
+  header.V_dims = snap.dims();
+  header.V_precision = sh.V_precision;
+  header.state_precision = sh.state_precision;
+  return header;
+}
+}  // namespace
+
 KWArgs SGDUpdater::Init(const KWArgs& kwargs) {
   auto remain = param_.InitAllowUnknown(kwargs);
   CHECK_GT(param_.V_dim, 0);
   CHECK_GT(param_.field_num, 0);
-  feat_dim = param_.V_dim * param_.field_num;
-  coef = 1.0f / sqrt(param_.V_dim);
-  distribution = std::uniform_real_distribution<float>(-param_.V_init_scale, param_.V_init_scale);
+  CHECK_NE(param_.state_precision, kFP16)
+      << "state_precision=fp16 overflows, use bf16 or fp32";
+  InitDims();
+  table_.reset(SGDTable::Create(param_.table));
+  if (param_.tier_threshold > 0) {
+    CHECK_GT(param_.tier_threshold, param_.V_threshold);
+    buckets_.reset(new SGDEntry[param_.num_buckets]);
+    for (int b = 0; b < param_.num_buckets; ++b) Account(buckets_[b], 1);
+  }
+  // with max_mem, the sketch also tells the evicted features from the unseen
+  if (param_.V_threshold > 0 || param_.tier_threshold > 0 || param_.max_mem > 0) {
+    admit_sketch_.Init(param_.admit_sketch_width, param_.admit_sketch_depth);
+    LOG(INFO) << "admission sketch uses " << admit_sketch_.MemSize() << " bytes";
+  }
+  if (param_.num_hot_keys > 0) hot_keys_.Init(param_.num_hot_keys * 16);
+  start_time_ = dmlc::GetTime();
+  last_stats_ = start_time_;
+  rng_ = param_.seed * 2654435761U + 1;
+  if (rng_ == 0) rng_ = 1;
+  // only the servers keep the model
+  if (param_.cold_path.size() && IsServer()) {
+    CHECK_GT(param_.max_mem, 0) << "cold_path requires max_mem";
+    cold_.Open(param_.cold_path + "." + std::to_string(getpid()));
+  }
+  if (param_.max_mem > 0 && IsServer()) {
+    evict_thread_ = std::unique_ptr<std::thread>(new std::thread([this]() {
+          while (!done_) {
+            for (int i = 0; i < param_.evict_interval * 10 && !done_; ++i) {
+              std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            if (!done_) Evict();
+          }
+        }));
+  }
   return remain;
 }
 
-void SGDUpdater::Evaluate(sgd::Progress* prog) const {
-  real_t objv = 0;
-  size_t nnz = 0;
+void SGDUpdater::InitDims() {
+  dims_.Init(param_.V_dims, param_.V_dim, param_.field_num);
+  feat_dim = dims_.size();
+  scratch_.resize(4 * dims_.max_dim());
+}
+
+void SGDUpdater::Load(dmlc::Stream* fi) {
+  Load(fi, 0, kBucketKey, true);
+}
+
+void SGDUpdater::Load(dmlc::Stream* fi, feaid_t begin, feaid_t end, bool buckets_too) {
+  SGDModelHeader header;
+  if (!header.Load(fi)) return;
+  AdoptHeader(header);
+  buckets_too = buckets_too || begin == kBucketKey;
+  std::vector<feaid_t> keys, bucket_ids;
+  std::vector<SGDEntry> vals, buckets;
+  int num_buckets = 0;
+  bool has_buckets = false;
+  if (header.codec != kCodecNone) {
+    LoadBlocks(fi, header, begin, end, &keys, &vals);
+    has_buckets = fi->Read(&num_buckets, sizeof(num_buckets)) == sizeof(num_buckets) &&
+        num_buckets > 0;
+    if (has_buckets && buckets_too) {
+      LoadBlocks(fi, header, 0, kBucketKey, &bucket_ids, &buckets);
+    }
+  } else {
+    // decode without the lock, so several files can be loaded at the same time
+    feaid_t key;
+    while (fi->Read(&key, sizeof(feaid_t)) == sizeof(feaid_t)) {
+      if (key == kBucketKey) {
+        has_buckets = true;
+        break;
+      }
+      SGDEntry e;
+      LoadEntry(fi, header, &e);
+      if (key < begin || key >= end) continue;
+      keys.push_back(key);
+      vals.push_back(std::move(e));
+    }
+  }
+  std::lock_guard<std::mutex> lk(mu_);
+  for (auto& e : vals) {
+    e.touched = now_;
+    Account(e, 1);
+    Tally(e, 1);
+  }
+  if (header.codec != kCodecNone) {
+    table_->InsertSorted(keys.data(), vals.data(), keys.size());
+  } else {
+    for (size_t i = 0; i < keys.size(); ++i) {
+      *table_->Insert(keys[i]) = std::move(vals[i]);
+      table_->Maintain();
+    }
+  }
+  LOG(INFO) << "loaded " << keys.size() << " kv pairs";
+  if (!has_buckets) return;
+  if (!buckets_too) {
+    LOG(INFO) << "skip the saved shared buckets, which are not resharded";
+  } else if (header.codec == kCodecNone) {
+    LoadBuckets(fi, header);
+  } else {
+    bool keep = buckets_ && num_buckets == param_.num_buckets;
+    if (!keep && buckets.size()) {
+      LOG(INFO) << "skip the " << num_buckets << " saved shared buckets";
+    }
+    for (size_t j = 0; keep && j < buckets.size(); ++j) {
+      SGDEntry& e = buckets_[bucket_ids[j]];
+      Account(e, -1);
+      Tally(e, -1);
+      e = std::move(buckets[j]);
+      Account(e, 1);
+      Tally(e, 1);
+    }
+  }
+}
+
+void SGDUpdater::AdoptHeader(const SGDModelHeader& header) {
+  if (feat_dim == 0 && !header.legacy()) {
+    // not inited, such as dumping a model, use the saved configuration
+    param_.optimizer = header.optimizer;
+    param_.V_dim = std::max(header.V_dim, 1);
+    param_.field_num = header.field_num;
+    param_.V_precision = header.V_precision;
+    param_.state_precision = header.state_precision;
+    param_.V_dims = FieldDims::Join(header.V_dims);
+    InitDims();
+  }
+  if (!header.legacy()) {
+    CHECK_EQ(header.field_num, param_.field_num);
+    CHECK(header.dims() == dims_.dims()) << "the dims of the model mismatch";
+  }
+}
+
+void SGDUpdater::Save(bool save_aux, dmlc::Stream *fo) const {
+  // all entries of a snapshot loaded lazily are needed
+  WaitLoad();
+  int64_t saved = 0;
+  Header(save_aux).Save(fo);
+  std::lock_guard<std::mutex> lk(mu_);
+  table_->ForEach([&](feaid_t key, const SGDEntry& e) {
+      if (e.empty()) return;
+      fo->Write(&key, sizeof(feaid_t));
+      SaveEntry(e, save_aux, fo);
+      saved ++ ;
+    });
+  // a cold record is an entry saved with its state, followed by its step and
+  // freq, so it is copied as is but the last two
+  size_t V_bytes = feat_dim * PrecBytes(param_.V_precision);
+  size_t Z_bytes = StateSize(param_.optimizer) * PrecBytes(param_.state_precision);
+  cold_.ForEach([&](feaid_t key, const std::string& rec) {
+      fo->Write(&key, sizeof(feaid_t));
+      fo->Write(rec.data(), sizeof(int) + V_bytes + (save_aux ? Z_bytes : 0));
+      saved ++ ;
+    });
+  if (buckets_) {
+    // the buckets are saved last, after a reserved key
+    fo->Write(&kBucketKey, sizeof(feaid_t));
+    fo->Write(&param_.num_buckets, sizeof(int));
+    for (int b = 0; b < param_.num_buckets; ++b) {
+      if (buckets_[b].V == nullptr) continue;
+      fo->Write(&b, sizeof(b));
+      SaveEntry(buckets_[b], save_aux, fo);
+    }
+  }
+  LOG(INFO) << "saved " << saved << " kv pairs";
+}
+
+namespace {
+inline void AppendSize(uint64_t n, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&n), sizeof(n));
+}
+}  // namespace
+
+void SGDUpdater::SaveModel(const std::string& filename, int format, bool save_aux,
+                           uint64_t chain) {
+  if (format == kModelSnapshot) {
+    SaveSnapshot(filename, save_aux, chain);
+    return;
+  }
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(filename.c_str(), "w"));
+  if (format == kModelStream) {
+    Save(save_aux, fo.get());
+  } else {
+    int codec = format == kModelCompressedInt8 ? kCodecLZ4Int8 : kCodecLZ4;
+    SaveCompressed(save_aux, codec, fo.get());
+  }
+}
+
+void SGDUpdater::SaveCompressed(bool save_aux, int codec, dmlc::Stream* fo) const {
+  WaitLoad();
+  SGDModelHeader header = Header(save_aux);
+  header.magic = SGDModelHeader::kMagicBlocks;
+  header.codec = codec;
+  header.Save(fo);
+  std::lock_guard<std::mutex> lk(mu_);
+  // the entries in memory, and the ones in the cold tier with nullptr
+  typedef std::pair<feaid_t, const SGDEntry*> Item;
+  std::vector<Item> items;
+  items.reserve(table_->size() + cold_.size());
+  table_->ForEach([&](feaid_t key, const SGDEntry& e) {
+      if (!e.empty()) items.push_back(Item(key, &e));
+    });
+  for (feaid_t key : cold_.Keys()) items.push_back(Item(key, nullptr));
+  ParallelSort(&items, param_.num_threads,
+               [](const Item& a, const Item& b) { return a.first < b.first; });
+  std::vector<feaid_t> keys(items.size());
+  std::vector<const SGDEntry*> entries(items.size());
+  for (size_t i = 0; i < items.size(); ++i) {
+    keys[i] = items[i].first;
+    entries[i] = items[i].second;
+  }
+  items.clear();
+
+  // num_threads blocks are encoded at a time, and written in order
+  const size_t block = 1 << 16;
+  size_t n = keys.size(), nblk = (n + block - 1) / block;
+  int nt = param_.num_threads;
+  std::vector<std::string> blks(nt);
+  for (size_t b0 = 0; b0 < nblk; b0 += nt) {
+    size_t b1 = std::min(nblk, b0 + nt);
+#pragma omp parallel for num_threads(nt)
+    for (size_t b = b0; b < b1; ++b) {
+      size_t begin = b * block, len = std::min(n, begin + block) - begin;
+      EncodeBlock(header, keys.data() + begin, entries.data() + begin, len, &blks[b - b0]);
+    }
+    for (size_t b = b0; b < b1; ++b) fo->Write(blks[b - b0].data(), blks[b - b0].size());
+  }
+  uint64_t end = 0;
+  fo->Write(&end, sizeof(end));
+
+  // the buckets go last, after their number
+  int num_buckets = buckets_ ? param_.num_buckets : 0;
+  fo->Write(&num_buckets, sizeof(num_buckets));
+  keys.clear(); entries.clear();
+  for (int b = 0; b < num_buckets; ++b) {
+    if (buckets_[b].V == nullptr) continue;
+    keys.push_back(b);
+    entries.push_back(&buckets_[b]);
+  }
+  if (keys.size()) {
+    EncodeBlock(header, keys.data(), entries.data(), keys.size(), &blks[0]);
+    fo->Write(blks[0].data(), blks[0].size());
+  }
+  fo->Write(&end, sizeof(end));
+  LOG(INFO) << "saved " << n << " kv pairs in " << nblk << " blocks";
+}
+
+void SGDUpdater::EncodeBlock(const SGDModelHeader& header, const feaid_t* keys,
+                             const SGDEntry* const* e, size_t n,
+                             std::string* blk) const {
+  // V of all entries, then the state of all entries
+  int vp = param_.V_precision;
+  bool int8 = header.codec == kCodecLZ4Int8;
+  size_t V_bytes = int8 ? codec::Int8Bytes(feat_dim) : feat_dim * PrecBytes(vp);
+  size_t Z_bytes = header.has_aux ?
+      StateSize(param_.optimizer) * PrecBytes(param_.state_precision) : 0;
+  std::vector<char> raw(n * (V_bytes + Z_bytes));
+  std::vector<real_t> buf(feat_dim + dims_.max_dim());
+  std::string rec;
+  for (size_t i = 0; i < n; ++i) {
+    char* V = raw.data() + i * V_bytes;
+    const char* Z;
+    if (e[i]) {
+      if (int8 || e[i]->T) {
+        CopyV(*e[i], buf.data(), buf.data() + feat_dim);
+        if (int8) {
+          codec::QuantizeInt8(buf.data(), feat_dim, V);
+        } else {
+          FromFloat(vp, buf.data(), feat_dim, V, nullptr);
+        }
+      } else {
+        memcpy(V, e[i]->V, V_bytes);
+      }
+      Z = e[i]->Z;
+    } else {
+      // a cold record is (size, V, state, step, freq)
+      CHECK(cold_.Get(keys[i], &rec)) << "key " << keys[i] << " is lost";
+      const char* rv = rec.data() + sizeof(int);
+      if (int8) {
+        ToFloat(vp, rv, feat_dim, buf.data());
+        codec::QuantizeInt8(buf.data(), feat_dim, V);
+      } else {
+        memcpy(V, rv, V_bytes);
+      }
+      Z = rv + feat_dim * PrecBytes(vp);
+    }
+    if (Z_bytes) memcpy(raw.data() + n * V_bytes + i * Z_bytes, Z, Z_bytes);
+  }
+  std::string enc;
+  codec::EncodeKeys(keys, n, &enc);
+  blk->clear();
+  AppendSize(n, blk);
+  AppendSize(enc.size(), blk);
+  blk->append(enc);
+  enc.clear();
+  codec::Compress(raw.data(), raw.size(), &enc);
+  AppendSize(raw.size(), blk);
+  AppendSize(enc.size(), blk);
+  blk->append(enc);
+}
+
+bool SGDUpdater::LoadBlocks(dmlc::Stream* fi, const SGDModelHeader& header,
+                            feaid_t begin, feaid_t end,
+                            std::vector<feaid_t>* keys, std::vector<SGDEntry>* vals) {
+  bool int8 = header.codec == kCodecLZ4Int8;
+  size_t V_bytes = int8 ? codec::Int8Bytes(feat_dim) :
+      feat_dim * PrecBytes(header.V_precision);
+  size_t Z_bytes = header.has_aux ?
+      StateSize(header.optimizer) * PrecBytes(header.state_precision) : 0;
+  // a quantized V is decoded into fp32
+  SGDModelHeader fp32 = header;
+  if (int8) fp32.V_precision = kFP32;
+  std::string enc, raw;
+  std::vector<feaid_t> ids;
+  auto read = [fi](void* p, size_t n) { CHECK_EQ(fi->Read(p, n), n) << "truncated model"; };
+  while (true) {
+    uint64_t n, size, raw_size;
+    if (fi->Read(&n, sizeof(n)) != sizeof(n)) return false;
+    if (n == 0) return true;
+    read(&size, sizeof(size));
+    enc.resize(size);
+    read(&enc[0], size);
+    ids.resize(n);
+    codec::DecodeKeys(enc.data(), size, n, ids.data());
+    // the keys are sorted, so the ones in the range are ids[lo, hi)
+    size_t lo = std::lower_bound(ids.begin(), ids.end(), begin) - ids.begin();
+    size_t hi = std::lower_bound(ids.begin(), ids.end(), end) - ids.begin();
+    read(&raw_size, sizeof(raw_size));
+    read(&size, sizeof(size));
+    CHECK_EQ(raw_size, n * (V_bytes + Z_bytes)) << "corrupted block";
+    enc.resize(size);
+    read(&enc[0], size);
+    if (lo == hi) continue;
+    raw.resize(raw_size);
+    codec::Decompress(enc.data(), size, &raw[0], raw_size);
+    size_t p = keys->size();
+    keys->insert(keys->end(), ids.begin() + lo, ids.begin() + hi);
+    vals->resize(p + hi - lo);
+#pragma omp parallel num_threads(param_.num_threads)
+    {
+      std::vector<real_t> V(feat_dim);
+#pragma omp for
+      for (size_t i = lo; i < hi; ++i) {
+        const char* v = raw.data() + i * V_bytes;
+        if (int8) {
+          codec::DequantizeInt8(v, feat_dim, V.data());
+          v = reinterpret_cast<const char*>(V.data());
+        }
+        SGDEntry* e = &(*vals)[p + i - lo];
+        e->size = feat_dim;
+        SetEntry(fp32, v, Z_bytes ? raw.data() + n * V_bytes + i * Z_bytes : nullptr, e);
+      }
+    }
+  }
+}
+
+void SGDUpdater::LoadBuckets(dmlc::Stream* fi, const SGDModelHeader& header) {
+  int num_buckets, b;
+  CHECK_EQ(fi->Read(&num_buckets, sizeof(int)), sizeof(int));
+  bool keep = buckets_ && num_buckets == param_.num_buckets;
+  if (!keep) LOG(INFO) << "skip the " << num_buckets << " saved shared buckets";
+  while (fi->Read(&b, sizeof(b)) == sizeof(b)) {
+    SGDEntry tmp;
+    SGDEntry& e = keep ? buckets_[b] : tmp;
+    if (keep) {
+      Account(e, -1);
+      Tally(e, -1);
+    }
+    LoadEntry(fi, header, &e);
+    if (!keep) continue;
+    Account(e, 1);
+    Tally(e, 1);
+  }
+}
+
+void SGDUpdater::LoadBuckets(const SGDSnapshot& snap, const SGDModelHeader& header) {
+  const SGDSnapshotHeader& sh = snap.header();
+  bool keep = buckets_ && sh.num_buckets == param_.num_buckets;
+  if (!keep && sh.buckets.num) {
+    LOG(INFO) << "skip the " << sh.num_buckets << " saved shared buckets";
+  }
+  for (size_t j = 0; keep && j < sh.buckets.num; ++j) {
+    SGDEntry& e = buckets_[snap.keys(sh.buckets)[j]];
+    Account(e, -1);
+    Tally(e, -1);
+    e.size = feat_dim;
+    SetEntry(header, snap.V(sh.buckets, j), snap.state(sh.buckets, j), &e);
+    e.touched = now_;
+    Account(e, 1);
+    Tally(e, 1);
+  }
+}
+
+void SGDUpdater::SaveSnapshot(const std::string& filename, bool save_aux, uint64_t chain) {
+  WriteSnapshot(filename, save_aux, false, chain);
+}
+
+void SGDUpdater::SaveDelta(const std::string& filename, bool save_aux,
+                           uint64_t chain, uint32_t seq) {
   mu_.lock();
-  for (const auto& it : model_) {
-    const auto& e = it.second;
-    for (int i = 0; i < feat_dim; ++i) {
-      if (e.V[i] != 0) {
-        objv += .5 * param_.l2 * e.V[i] * e.V[i];
-        nnz += 1;
+  bool full = chain_ == 0 || chain_name_ != filename;
+  // the delta the caller asks for does not follow the last checkpoint
+  bool lost = !full && chain && (chain != chain_ || seq != seq_ + 1);
+  uint64_t last_chain = chain_;
+  uint32_t last_seq = seq_;
+  mu_.unlock();
+  if (full) {
+    LOG(INFO) << filename << " has no chain, save a full snapshot";
+  } else if (lost) {
+    LOG(WARNING) << "delta " << seq << " of chain " << chain << " does not follow "
+                 << last_seq << " of chain " << last_chain << ", save a full snapshot";
+  }
+  WriteSnapshot(filename, save_aux, !full && !lost, chain);
+}
+
+void SGDUpdater::SetCheckpoint(const std::string& filename, bool save_aux,
+                               int num_deltas, int interval, int batches) {
+  std::lock_guard<std::mutex> lk(mu_);
+  ckpt_file_ = filename;
+  ckpt_aux_ = save_aux;
+  ckpt_deltas_ = num_deltas;
+  ckpt_interval_ = interval;
+  ckpt_batches_ = batches;
+  last_ckpt_ = dmlc::GetTime();
+}
+
+void SGDUpdater::StartCheckpoint() {
+  if (ckpt_busy_) return;
+  if (ckpt_thread_) ckpt_thread_->join();
+  bool full = num_auto_ckpts_ % (ckpt_deltas_ + 1) == 0;
+  ++ num_auto_ckpts_;
+  last_ckpt_ = dmlc::GetTime();
+  num_pushes_ = 0;
+  ckpt_busy_ = true;
+  ckpt_thread_ = std::unique_ptr<std::thread>(new std::thread([this, full]() {
+        if (full) {
+          SaveSnapshot(ckpt_file_, ckpt_aux_);
+        } else {
+          SaveDelta(ckpt_file_, ckpt_aux_);
+        }
+        ckpt_busy_ = false;
+      }));
+}
+
+void SGDUpdater::WriteSnapshot(const std::string& filename, bool save_aux, bool delta,
+                               uint64_t chain) {
+  WaitLoad();
+  // one snapshot is written at a time
+  std::lock_guard<std::mutex> wlk(write_mu_);
+  int vp = param_.V_precision;
+  std::unique_ptr<SGDSnapshot> snap(new SGDSnapshot());
+  std::string name, old_log;
+  size_t n, num_erased;
+  uint32_t seq;
+  {
+    // take the keys, and write the copies of the entries from now on
+    std::lock_guard<std::mutex> lk(mu_);
+    std::vector<feaid_t> keys, erased;
+    keys.reserve(delta ? 0 : table_->size() + cold_.size());
+    table_->ForEach([&](feaid_t key, const SGDEntry& e) {
+        if (delta && !Dirty(e)) return;
+        if (!e.empty()) {
+          keys.push_back(key);
+        } else if (delta && e.V) {
+          erased.push_back(key);
+        }
+      });
+    if (delta) {
+      keys.insert(keys.end(), dirty_cold_.begin(), dirty_cold_.end());
+      erased.insert(erased.end(), erased_.begin(), erased_.end());
+      std::sort(erased.begin(), erased.end());
+      erased.erase(std::unique(erased.begin(), erased.end()), erased.end());
+    } else {
+      for (feaid_t key : cold_.Keys()) keys.push_back(key);
+    }
+    ParallelSort(&keys, param_.num_threads, std::less<feaid_t>());
+    std::vector<int> bucket_ids;
+    for (int b = 0; buckets_ && b < param_.num_buckets; ++b) {
+      if (buckets_[b].V && (!delta || Dirty(buckets_[b]))) bucket_ids.push_back(b);
+    }
+
+    SGDSnapshotHeader header;
+    header.has_aux = save_aux;
+    header.optimizer = param_.optimizer;
+    header.field_num = param_.field_num;
+    header.V_precision = vp;
+    header.state_precision = param_.state_precision;
+    header.num_buckets = buckets_ ? param_.num_buckets : 0;
+    header.V_stride = feat_dim * PrecBytes(vp);
+    header.state_stride = save_aux ?
+        StateSize(param_.optimizer) * PrecBytes(param_.state_precision) : 0;
+    header.seq = delta ? seq_ + 1 : 0;
+    if (delta) {
+      header.chain = chain_;
+    } else {
+      header.chain = chain ? chain : static_cast<uint64_t>(dmlc::GetTime() * 1e6);
+    }
+    header.Layout(keys.size(), bucket_ids.size(), erased.size());
+    name = delta ? DeltaName(filename, header.seq) : filename;
+    snap->Create(name, header, dims_.dims());
+    std::copy(keys.begin(), keys.end(), snap->keys(header.entries));
+    std::copy(erased.begin(), erased.end(), snap->keys(header.erased));
+    // the buckets are few, so they are written now
+    std::vector<real_t> buf(feat_dim + dims_.max_dim());
+    for (size_t j = 0; j < bucket_ids.size(); ++j) {
+      snap->keys(header.buckets)[j] = bucket_ids[j];
+      PutEntry(snap.get(), header.buckets, j, buckets_[bucket_ids[j]], buf.data());
+    }
+    n = keys.size();
+    num_erased = erased.size();
+    seq = header.seq;
+
+    // all entries are clean now
+    ++ num_ckpts_;
+    chain_ = header.chain;
+    seq_ = header.seq;
+    chain_name_ = filename;
+    erased_.clear();
+    dirty_cold_.clear();
+    cow_snap_ = snap.get();
+    cow_done_.assign(n, false);
+    cow_pos_ = 0;
+    // the updates from now on are logged after this checkpoint
+    if (log_.is_open() && filename == log_file_) {
+      old_log = log_.filename();
+      log_.Link(LogName(filename, chain_, seq_));
+      log_.Open(LogName(filename, chain_, seq_));
+    }
+  }
+
+  // the entries not changed yet are written in chunks, and the requests are
+  // served between two chunks
+  const auto& sec = snap->header().entries;
+  const feaid_t* keys = snap->keys(sec);
+  const size_t chunk = 1 << 16;
+  for (size_t pos = 0; pos < n; pos += chunk) {
+    std::lock_guard<std::mutex> lk(mu_);
+    size_t end = std::min(n, pos + chunk);
+#pragma omp parallel num_threads(param_.num_threads)
+    {
+      std::vector<real_t> buf(feat_dim + dims_.max_dim());
+      std::string rec;
+#pragma omp for
+      for (size_t i = pos; i < end; ++i) {
+        if (cow_done_[i]) continue;
+        const SGDEntry* e = table_->Find(keys[i]);
+        if (e) {
+          PutEntry(snap.get(), sec, i, *e, buf.data());
+        } else {
+          CHECK(cold_.Get(keys[i], &rec)) << "key " << keys[i] << " is lost";
+          PutRecord(snap.get(), sec, i, rec);
+        }
       }
     }
+    cow_pos_ = end;
   }
+  mu_.lock();
+  cow_snap_ = nullptr;
+  cow_done_.clear();
   mu_.unlock();
-  prog->penalty = objv;
-  prog->nnz_w = nnz;
+  snap->Close();
+  if (old_log.size()) unlink(old_log.c_str());
+  // the deltas of the previous chain, or the later ones of this chain left by
+  // a run resumed from an earlier checkpoint, are stale now
+  for (uint32_t k = seq + 1; SGDSnapshot::Is(DeltaName(filename, k)); ++k) {
+    SGDSnapshot::Remove(DeltaName(filename, k));
+  }
+  LOG(INFO) << "saved " << n << " kv pairs and " << num_erased
+            << " erased keys into " << name;
+}
+
+void SGDUpdater::CopyOnWrite(feaid_t key, const SGDEntry& e) {
+  const auto& sec = cow_snap_->header().entries;
+  const feaid_t* keys = cow_snap_->keys(sec);
+  const feaid_t* it = std::lower_bound(keys + cow_pos_, keys + sec.num, key);
+  if (it == keys + sec.num || *it != key) return;
+  size_t i = it - keys;
+  if (cow_done_[i]) return;
+  std::vector<real_t> buf(feat_dim + dims_.max_dim());
+  PutEntry(cow_snap_, sec, i, e, buf.data());
+  cow_done_[i] = true;
+}
+
+void SGDUpdater::PutEntry(SGDSnapshot* snap, const SGDSnapshotHeader::Section& sec,
+                          size_t i, const SGDEntry& e, real_t* buf) const {
+  const SGDSnapshotHeader& header = snap->header();
+  char* V = snap->V(sec, i);
+  if (e.T) {
+    // the pending l2 decay is applied, so T needs not to be saved
+    CopyV(e, buf, buf + feat_dim);
+    FromFloat(header.V_precision, buf, feat_dim, V, nullptr);
+  } else {
+    memcpy(V, e.V, header.V_stride);
+  }
+  if (header.has_aux) memcpy(snap->state(sec, i), e.Z, header.state_stride);
+}
+
+void SGDUpdater::PutRecord(SGDSnapshot* snap, const SGDSnapshotHeader::Section& sec,
+                           size_t i, const std::string& rec) const {
+  // a cold record is (size, V, state, step, freq), the first three are
+  // copied as is
+  const SGDSnapshotHeader& header = snap->header();
+  const char* V = rec.data() + sizeof(int);
+  memcpy(snap->V(sec, i), V, header.V_stride);
+  if (header.has_aux) {
+    memcpy(snap->state(sec, i), V + header.V_stride, header.state_stride);
+  }
+}
+
+void SGDUpdater::LoadSnapshot(const std::string& filename, feaid_t begin, feaid_t end,
+                              bool follow_chain) {
+  SGDSnapshot snap;
+  snap.Open(filename);
+  const SGDSnapshotHeader& sh = snap.header();
+  SGDModelHeader header = ModelHeader(snap);
+  AdoptHeader(header);
+  CHECK_EQ(sh.V_stride, feat_dim * PrecBytes(sh.V_precision));
+  bool all = follow_chain && begin == 0 && end == kBucketKey;
+  // the keys are sorted, so only the pages of [lo, lo + n) are read
+  const feaid_t* keys = snap.keys(sh.entries);
+  size_t lo = std::lower_bound(keys, keys + sh.entries.num, begin) - keys;
+  size_t n = std::lower_bound(keys, keys + sh.entries.num, end) - keys - lo;
+  keys += lo;
+  std::vector<SGDEntry> vals(n);
+#pragma omp parallel for num_threads(param_.num_threads)
+  for (size_t i = 0; i < n; ++i) {
+    vals[i].size = feat_dim;
+    SetEntry(header, snap.V(sh.entries, lo + i), snap.state(sh.entries, lo + i), &vals[i]);
+    vals[i].touched = now_;
+  }
+
+  std::lock_guard<std::mutex> lk(mu_);
+  if (sh.seq) {
+    CHECK(!all || (sh.chain == chain_ && sh.seq == seq_ + 1))
+        << filename << " does not follow the last snapshot loaded";
+    // the erased keys go first, since a key may be erased and then inserted
+    const feaid_t* erased = snap.keys(sh.erased);
+    for (size_t i = 0; i < sh.erased.num; ++i) {
+      if (erased[i] < begin || erased[i] >= end) continue;
+      SGDEntry* e = table_->Find(erased[i]);
+      if (e) {
+        Account(*e, -1);
+        Tally(*e, -1);
+        table_->Erase(erased[i]);
+      }
+      if (cold_.is_open()) cold_.Erase(erased[i]);
+      if (lazy_) SkipLazy(erased[i]);
+    }
+    // the changed entries replace the existing ones
+    for (size_t i = 0; i < n; ++i) {
+      SGDEntry* e = table_->Find(keys[i]);
+      if (e) {
+        Account(*e, -1);
+        Tally(*e, -1);
+      }
+      if (cold_.is_open()) cold_.Erase(keys[i]);
+      if (lazy_) SkipLazy(keys[i]);
+    }
+  }
+  for (const auto& e : vals) {
+    Account(e, 1);
+    Tally(e, 1);
+  }
+  table_->InsertSorted(keys, vals.data(), n);
+  LOG(INFO) << "loaded " << n << " kv pairs from " << filename;
+  if (begin == kBucketKey) LoadBuckets(snap, header);
+  if (!all) {
+    // the chain is only followed by the server which saved it
+    if (sh.buckets.num && begin != kBucketKey) {
+      LOG(INFO) << "skip the saved shared buckets, which are not resharded";
+    }
+    return;
+  }
+  LoadBuckets(snap, header);
+  chain_ = sh.chain;
+  seq_ = sh.seq;
+  if (sh.seq == 0) chain_name_ = filename;
+}
+
+void SGDUpdater::LoadModel(const std::string& filename, feaid_t begin, feaid_t end,
+                           bool follow_chain, uint64_t chain, uint32_t seq) {
+  WaitLoad();
+  SGDSnapshotHeader header;
+  if (SGDSnapshot::ReadHeader(filename, &header)) {
+    CHECK(!chain || header.chain == chain)
+        << filename << " is not of chain " << chain
+        << ", the checkpoint was overwritten by a later one";
+    LoadSnapshot(filename, begin, end, follow_chain);
+    // replay the deltas of its chain in order, up to seq if given
+    uint32_t last = chain ? seq : std::numeric_limits<uint32_t>::max();
+    chain = header.chain;
+    for (uint32_t k = header.seq + 1; k <= last &&
+             SGDSnapshot::ReadHeader(DeltaName(filename, k), &header); ++k) {
+      if (header.chain != chain || header.seq != k) {
+        LOG(INFO) << "skip " << DeltaName(filename, k) << " of another chain";
+        break;
+      }
+      LoadSnapshot(DeltaName(filename, k), begin, end, follow_chain);
+    }
+    return;
+  }
+  std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(filename.c_str(), "r"));
+  Load(fi.get(), begin, end, follow_chain && begin == 0 && end == kBucketKey);
+}
+
+void SGDUpdater::LoadShards(const std::vector<std::string>& files,
+                            feaid_t begin, feaid_t end, uint64_t chain, uint32_t seq) {
+  // the files have disjoint keys, so they can be loaded in any order. each
+  // file follows only its own chain, even if all keys are loaded by one server
+  std::atomic<size_t> next{0};
+  int nt = std::min(static_cast<size_t>(param_.num_threads), files.size());
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nt; ++t) {
+    threads.emplace_back([&]() {
+        for (size_t i = next++; i < files.size(); i = next++) {
+          LoadModel(files[i], begin, end, false, chain, seq);
+        }
+      });
+  }
+  for (auto& t : threads) t.join();
+  LOG(INFO) << "loaded the keys in [" << begin << ", " << end << ") from "
+            << files.size() << " model files";
+  if (buckets_) {
+    // the shared buckets of the servers are not merged, take the ones of the
+    // first file rather than starting the tail features from scratch
+    LoadModel(files[0], kBucketKey, kBucketKey, false, chain, seq);
+  }
+}
+
+void SGDUpdater::LoadLazy(const std::string& filename) {
+  WaitLoad();
+  SGDSnapshotHeader header;
+  if (!SGDSnapshot::ReadHeader(filename, &header) || header.seq) {
+    LOG(INFO) << filename << " is not a full snapshot, load it at once";
+    LoadModel(filename);
+    return;
+  }
+  std::unique_ptr<SGDSnapshot> snap(new SGDSnapshot());
+  snap->Open(filename);
+  const SGDSnapshotHeader& sh = snap->header();
+  AdoptHeader(ModelHeader(*snap));
+  CHECK_EQ(sh.V_stride, feat_dim * PrecBytes(sh.V_precision));
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    LoadBuckets(*snap, ModelHeader(*snap));
+    chain_ = sh.chain;
+    seq_ = 0;
+    chain_name_ = filename;
+    lazy_header_ = ModelHeader(*snap);
+    lazy_done_.assign(sh.entries.num, false);
+    lazy_ = std::move(snap);
+    num_faults_ = 0;
+    loading_ = true;
+  }
+  LOG(INFO) << "opened " << filename << " with " << sh.entries.num
+            << " kv pairs, which are loaded on demand";
+  // the deltas replace the entries of the snapshot
+  for (uint32_t k = 1; SGDSnapshot::ReadHeader(DeltaName(filename, k), &header); ++k) {
+    if (header.chain != chain_ || header.seq != k) {
+      LOG(INFO) << "skip " << DeltaName(filename, k) << " of another chain";
+      break;
+    }
+    LoadSnapshot(DeltaName(filename, k));
+  }
+  if (load_thread_) load_thread_->join();
+  load_thread_ = std::unique_ptr<std::thread>(new std::thread([this]() { LoadRest(); }));
+}
+
+SGDEntry* SGDUpdater::FaultIn(feaid_t key) {
+  const auto& sec = lazy_->header().entries;
+  const feaid_t* keys = lazy_->keys(sec);
+  size_t i = std::lower_bound(keys, keys + sec.num, key) - keys;
+  if (i == sec.num || keys[i] != key || lazy_done_[i]) return nullptr;
+  lazy_done_[i] = true;
+  SGDEntry* e = table_->Insert(key);
+  e->size = feat_dim;
+  SetEntry(lazy_header_, lazy_->V(sec, i), lazy_->state(sec, i), e);
+  e->touched = now_;
+  Account(*e, 1);
+  Tally(*e, 1);
+  ++ num_faults_;
+  return e;
+}
+
+void SGDUpdater::SkipLazy(feaid_t key) {
+  const auto& sec = lazy_->header().entries;
+  const feaid_t* keys = lazy_->keys(sec);
+  size_t i = std::lower_bound(keys, keys + sec.num, key) - keys;
+  if (i < sec.num && keys[i] == key) lazy_done_[i] = true;
+}
+
+void SGDUpdater::LoadRest() {
+  const auto& sec = lazy_->header().entries;
+  const feaid_t* keys = lazy_->keys(sec);
+  const size_t chunk = 1 << 16;
+  std::vector<SGDEntry> vals;
+  std::vector<feaid_t> ids;
+  size_t loaded = 0;
+  for (size_t p = 0; p < sec.num && !done_; p += chunk) {
+    // decode without the lock, then insert the ones still not loaded
+    size_t n = std::min(chunk, sec.num - p);
+    std::vector<SGDEntry> chunk_vals(n);
+#pragma omp parallel for num_threads(param_.num_threads)
+    for (size_t i = 0; i < n; ++i) {
+      chunk_vals[i].size = feat_dim;
+      SetEntry(lazy_header_, lazy_->V(sec, p + i), lazy_->state(sec, p + i), &chunk_vals[i]);
+    }
+    std::lock_guard<std::mutex> lk(mu_);
+    ids.clear();
+    vals.clear();
+    for (size_t i = 0; i < n; ++i) {
+      if (lazy_done_[p + i]) continue;
+      lazy_done_[p + i] = true;
+      SGDEntry& e = chunk_vals[i];
+      e.touched = now_;
+      Account(e, 1);
+      Tally(e, 1);
+      ids.push_back(keys[p + i]);
+      vals.push_back(std::move(e));
+    }
+    table_->InsertSorted(ids.data(), vals.data(), ids.size());
+    loaded += ids.size();
+  }
+  std::lock_guard<std::mutex> lk(mu_);
+  LOG(INFO) << "loaded " << loaded << " kv pairs in the background and "
+            << num_faults_ << " on demand";
+  lazy_.reset();
+  lazy_done_ = std::vector<bool>();
+  loading_ = false;
+}
+
+void SGDUpdater::WaitLoad() const {
+  while (loading_) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+
+void SGDUpdater::StartUpdateLog(const std::string& filename) {
+  std::lock_guard<std::mutex> lk(mu_);
+  log_file_ = filename;
+  log_.Open(LogName(filename, chain_, seq_));
+}
+
+void SGDUpdater::Recover(const std::string& filename, bool save_aux) {
+  if (SGDSnapshot::Is(filename)) {
+    LoadModel(filename);
+  } else {
+    LOG(WARNING) << "no checkpoint " << filename << ", recover from the updates only";
+  }
+  // replay the log after the last file loaded, and the ones it links to,
+  // which are left if the server was killed while saving a checkpoint
+  std::vector<std::string> logs{LogName(filename, chain_, seq_)};
+  std::string next;
+  size_t num_updates = 0, size = 0;
+  mu_.lock();
+  replaying_ = true;
+  mu_.unlock();
+  while (true) {
+    size = UpdateLog::Replay(logs.back(), [&](
+        int type, const SArray<feaid_t>& keys, const SArray<real_t>& vals,
+        const SArray<int>& lens) {
+        Update(keys, type, vals, lens);
+        ++ num_updates;
+      }, &next);
+    if (next.empty()) break;
+    logs.push_back(next);
+  }
+  LOG(INFO) << "replayed " << num_updates << " updates logged after " << filename;
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    replaying_ = false;
+    log_file_ = filename;
+    log_.Open(logs.back(), size);
+  }
+  if (logs.size() > 1) {
+    // the name of the log of the checkpoint not saved may be used again, so
+    // start a new chain
+    SaveSnapshot(filename, save_aux);
+    for (size_t i = 0; i + 1 < logs.size(); ++i) unlink(logs[i].c_str());
+  }
+}
+
+void SGDUpdater::Dump(bool dump_aux, bool need_reverse, dmlc::Stream *fo) const {
+  DumpParts(dump_aux, need_reverse, {fo});
+}
+
+void SGDUpdater::DumpParts(bool dump_aux, bool need_reverse,
+                           const std::vector<dmlc::Stream*>& fos) const {
+  WaitLoad();
+  typedef std::pair<feaid_t, const SGDEntry*> Item;
+  int m = StateSize(param_.optimizer);
+  int nt = param_.num_threads;
+  std::lock_guard<std::mutex> lk(mu_);
+  // the entries in memory, and the ones in the cold tier with nullptr
+  std::vector<Item> items;
+  items.reserve(table_->size() + cold_.size());
+  table_->ForEach([&](feaid_t key, const SGDEntry& e) {
+      if (!e.empty()) items.push_back(Item(key, &e));
+    });
+  for (feaid_t key : cold_.Keys()) items.push_back(Item(key, nullptr));
+  ParallelSort(&items, nt,
+               [](const Item& a, const Item& b) { return a.first < b.first; });
+  if (buckets_) {
+    LOG(WARNING) << "the " << param_.num_buckets
+                 << " shared buckets have no keys, and are not dumped";
+  }
+
+  // format the lines of items[begin, end) into out
+  size_t max_line = (2 + feat_dim + (dump_aux ? m : 0)) * (kMaxFormatLen + 1);
+  size_t V_bytes = feat_dim * PrecBytes(param_.V_precision);
+  auto format = [&](size_t begin, size_t end, std::string* out) {
+    std::vector<real_t> V(feat_dim + dims_.max_dim()), Z(m);
+    std::string rec;
+    out->resize(max_line * (end - begin));
+    char* p = &(*out)[0];
+    for (size_t i = begin; i < end; ++i) {
+      const SGDEntry* e = items[i].second;
+      char const* Z_in;
+      int size = feat_dim;
+      if (e) {
+        size = e->size;
+        CopyV(*e, V.data(), V.data() + feat_dim);
+        Z_in = e->Z;
+      } else {
+        // a cold record is (size, V, state, step, freq), with the decay applied
+        CHECK(cold_.Get(items[i].first, &rec)) << "key " << items[i].first << " is lost";
+        ToFloat(param_.V_precision, rec.data() + sizeof(int), feat_dim, V.data());
+        Z_in = rec.data() + sizeof(int) + V_bytes;
+      }
+      feaid_t key = need_reverse ? ReverseBytes(items[i].first) : items[i].first;
+      p = FormatUInt(key, p);
+      *p++ = '\t';
+      p = FormatInt(size, p);
+      for (int k = 0; k < size; ++k) {
+        *p++ = '\t';
+        p = FormatFloat(V[k], p);
+      }
+      if (dump_aux) {
+        ToFloat(param_.state_precision, Z_in, m, Z.data());
+        for (int k = 0; k < m; ++k) {
+          *p++ = '\t';
+          p = FormatFloat(Z[k], p);
+        }
+      }
+      *p++ = '\n';
+    }
+    out->resize(p - out->data());
+  };
+
+  size_t n = items.size();
+  const size_t chunk = 1 << 14;
+  if (fos.size() == 1) {
+    // nt chunks are formatted at a time, and written in order
+    std::vector<std::string> bufs(nt);
+    for (size_t c0 = 0; c0 < n; c0 += chunk * nt) {
+#pragma omp parallel for num_threads(nt)
+      for (int t = 0; t < nt; ++t) {
+        size_t begin = std::min(n, c0 + t * chunk);
+        format(begin, std::min(n, begin + chunk), &bufs[t]);
+      }
+      for (const auto& buf : bufs) fos[0]->Write(buf.data(), buf.size());
+    }
+  } else {
+    // a part is a key range, which is formatted and written by one thread
+    int np = fos.size();
+#pragma omp parallel for num_threads(std::min(nt, np))
+    for (int k = 0; k < np; ++k) {
+      std::string buf;
+      for (size_t c = n * k / np, end = n * (k + 1) / np; c < end; c += chunk) {
+        format(c, std::min(end, c + chunk), &buf);
+        fos[k]->Write(buf.data(), buf.size());
+      }
+    }
+  }
+  LOG(INFO) << "dumped " << n << " kv pairs into " << fos.size() << " parts";
+}
+
+void SGDUpdater::Evaluate(sgd::Progress* prog) const {
+  // the entries being loaded lazily are not counted yet
+  WaitLoad();
+  std::lock_guard<std::mutex> lk(mu_);
+  prog->penalty = penalty_;
+  prog->nnz_w = stats_.nnz_w + new_w;
+}
+
+double SGDUpdater::Penalty(const SGDEntry& e) const {
+  if (e.V == nullptr) return 0;
+  std::vector<real_t> V(e.size);
+  ToFloat(param_.V_precision, e.V, e.size, V.data());
+  return Penalty(V.data(), e.size);
+}
+
+std::string SGDUpdater::Get_report() {
+  // the counters are also changed by the eviction and the loading threads
+  std::lock_guard<std::mutex> lk(mu_);
+  sgd::Progress report_prog; report_prog.nnz_w = new_w;
+  report_prog.num_evicted = num_evicted_;
+  report_prog.staleness = staleness_;
+  report_prog.num_stale = num_stale_;
+  std::string rets;
+  report_prog.SerializeToString(&rets);
+  stats_.nnz_w += new_w;
+  new_w = 0; num_evicted_ = 0;
+  staleness_ = 0; num_stale_ = 0;
+  double now = dmlc::GetTime();
+  if (param_.stats_interval > 0 && now - last_stats_ >= param_.stats_interval) {
+    last_stats_ = now;
+    stats_.num_entries = table_->size();
+    stats_.num_cold = cold_.size();
+    stats_.load_factor = table_->LoadFactor();
+    if (!hot_keys_.empty()) {
+      stats_.num_pushed = hot_keys_.total();
+      stats_.hot_keys = hot_keys_.Top(param_.num_hot_keys);
+    }
+    std::string stats;
+    stats_.SerializeToString(&stats);
+    rets += stats;
+  }
+  return rets;
 }
 
 void SGDUpdater::Get(const SArray<feaid_t>& fea_ids,
                      int val_type,
                      SArray<real_t>* weights,
                      SArray<int>* lens) {
+  GetRows(fea_ids, val_type, SArray<real_t>(), weights, lens);
+}
+
+void SGDUpdater::GetRows(const SArray<feaid_t>& fea_ids,
+                         int val_type,
+                         const SArray<real_t>& masks,
+                         SArray<real_t>* weights,
+                         SArray<int>* lens) {
   CHECK_EQ(val_type, Store::kWeight);
   size_t size = fea_ids.size();
-  weights->resize(size * feat_dim);
+  // all rows if no masks
+  int mask_size = masks.empty() ? 0 : dims_.mask_size();
+  CHECK_EQ(masks.size(), size * mask_size);
+  // the version of the entry goes first if staleness aware
+  int ver = param_.staleness_aware ? 1 : 0;
+  weights->resize(size * (feat_dim + ver));
   lens->resize(size);
   int p = 0;
+  std::lock_guard<std::mutex> lk(mu_);
+  std::vector<SGDEntry*> entries(size);
+  FindAll(fea_ids, entries.data());
+  SGDEntry evicted;
   for (size_t i = 0; i < size; ++i) {
-    mu_.lock();
-    auto& e = model_[fea_ids[i]];
-    mu_.unlock();
-    if (e.empty()) {
+    SGDEntry* e = entries[i];
+    feaid_t key = fea_ids[i];
+    if (!e && Tail(key)) {
+      key = BucketIdx(key);
+      e = &buckets_[key];
+    } else if (!e && Evicted(key)) {
+      // served as the initial value, its entry is created on its gradient
+      e = &evicted;
+    } else if (!e || (e->V && e->empty())) {
       (*lens)[i] = 0;
+      continue;
+    }
+    if (ver) (*weights)[p] = VersionToReal(e->step);
+    int len = feat_dim;
+    if (mask_size) {
+      real_t const* mask = masks.data() + i * mask_size;
+      len = dims_.PackedSize(mask) - mask_size;
+      ReadRows(key, *e, mask, weights->data()+p+ver);
     } else {
-      memcpy(weights->data()+p, e.V, feat_dim * sizeof(real_t));
-      p += feat_dim;
-      (*lens)[i] = feat_dim;
+      ReadV(key, *e, weights->data()+p+ver);
     }
+    p += len + ver;
+    (*lens)[i] = len + ver;
   }
   weights->resize(p);
+  table_->Maintain();
 }
 
 void SGDUpdater::Update(const SArray<feaid_t>& fea_ids,
                         int value_type,
                         const SArray<real_t>& values,
                         const SArray<int>& lens) {
+  if (value_type == Store::kGradientCodes) {
+    // decoded before taking the lock, and logged as the decoded rows
+    SArray<real_t> rows;
+    SArray<int> rows_lens;
+    DequantizeRows(dims_, param_.grad_bits, param_.staleness_aware ? 1 : 0,
+                   values, lens, &rows, &rows_lens);
+    Update(fea_ids, Store::kGradientRows, rows, rows_lens);
+    return;
+  }
   if (value_type == Store::kFeaCount) {
     CHECK_EQ(fea_ids.size(), values.size());
+    std::lock_guard<std::mutex> lk(mu_);
+    if (log_.is_open()) log_.Append(value_type, fea_ids, values, lens);
     for (size_t i = 0; i < fea_ids.size(); ++i) {
-      mu_.lock();
-      auto& e = model_[fea_ids[i]];
-      mu_.unlock();
-      e.fea_cnt += values[i];
-      if (e.V == nullptr && e.fea_cnt > param_.V_threshold) {
-        InitV(&e);
+      // count in the sketch, an entry is only created once admitted
+      real_t cnt = admit_sketch_.empty() ? 0 : admit_sketch_.Add(fea_ids[i], values[i]);
+      if (param_.V_threshold > 0 && cnt <= param_.V_threshold) continue;
+      // tail features share the buckets until they reach the tier
+      if (buckets_ && cnt < param_.tier_threshold) continue;
+      // V is allocated on the first gradient
+      if (Find(fea_ids[i])) continue;
+      auto& e = *table_->Insert(fea_ids[i]);
+      e.touched = now_;
+      Account(e, 1);
+      const SGDEntry& bucket = buckets_ ? buckets_[BucketIdx(fea_ids[i])] : e;
+      if (bucket.V) {
+        // promoted, start from the bucket it shared
+        std::vector<real_t> V(feat_dim);
+        CopyV(bucket, V.data());
+        AllocV(V.data(), &e);
       }
     }
-  } else if (value_type == Store::kGradient) {
+    if (!admit_sketch_.empty() && param_.admit_decay < 1 && !replaying_ &&
+        ++ num_cnt_pushes_ % param_.admit_decay_interval == 0) {
+      admit_sketch_.Decay(param_.admit_decay);
+    }
+    table_->Maintain();
+  } else if (value_type == Store::kGradient || value_type == Store::kGradientRows) {
     size_t size = fea_ids.size();
     CHECK_EQ(lens.size(), size);
     int p = 0;
     real_t* v = values.data();
+    std::lock_guard<std::mutex> lk(mu_);
+    if (log_.is_open()) log_.Append(value_type, fea_ids, values, lens);
+    now_ = static_cast<uint32_t>(dmlc::GetTime() - start_time_);
+    std::vector<SGDEntry*> entries(size);
+    FindAll(fea_ids, entries.data());
+    int ver = param_.staleness_aware ? 1 : 0;
+    bool rows = value_type == Store::kGradientRows;
     for (size_t i = 0; i < size; ++i) {
       if (lens[i] == 0) continue;
-      mu_.lock();
-      auto& e = model_[fea_ids[i]];
-      mu_.unlock();
-      CHECK_EQ(lens[i], feat_dim);
-      CHECK(e.V != nullptr) << fea_ids[i];
-      UpdateV(v+p, &e);
-      p += feat_dim;
+      // the row mask follows the version
+      real_t const* mask = rows ? v+p+ver : nullptr;
+      int mask_size = rows ? dims_.mask_size() : 0;
+      CHECK_EQ(lens[i], ver + (rows ? dims_.PackedSize(mask) : feat_dim));
+      if (!hot_keys_.empty()) hot_keys_.Add(fea_ids[i], 1);
+      SGDEntry* e = entries[i];
+      feaid_t key = fea_ids[i];
+      bool tail = !e && Tail(key);
+      if (tail) {
+        key = BucketIdx(key);
+        e = &buckets_[key];
+      } else if (!e && Evicted(key)) {
+        // it gets its own entry again, which starts from the initial value
+        e = table_->Insert(key);
+        e->touched = now_;
+        Account(*e, 1);
+      }
+      // the entry may have been released or evicted after the worker pulled it
+      if (e) {
+        if (!tail) Preserve(key, *e);
+        if (e->released()) {
+          // V starts from zero again, and FTRL goes on from its state
+          Account(*e, -1);
+          e->V = new char[feat_dim * PrecBytes(param_.V_precision)]();
+          Account(*e, 1);
+        } else if (e->V == nullptr) {
+          InitV(key, e);
+        }
+        real_t lr_scale = 1;
+        if (ver) {
+          // the number of updates applied since the worker pulled it
+          uint32_t version = RealToVersion(v[p]);
+          uint32_t staleness = e->step > version ? e->step - version : 0;
+          lr_scale = 1.0f / (1 + staleness);
+          staleness_ += staleness;
+          ++ num_stale_;
+        }
+        UpdateV(v+p+ver+mask_size, mask, e, lr_scale);
+        // all of V is exactly zero, release it
+        if (e->empty() && !tail) Release(key, e);
+      }
+      p += lens[i];
     }
     CHECK_EQ(static_cast<size_t>(p), values.size());
+    table_->Maintain();
+    if (ckpt_file_.size() && !replaying_ && (
+            (ckpt_batches_ > 0 && ++ num_pushes_ >= ckpt_batches_) ||
+            (ckpt_interval_ > 0 && dmlc::GetTime() - last_ckpt_ >= ckpt_interval_ * 60))) {
+      StartCheckpoint();
+    }
   } else {
     LOG(FATAL) << "UNKNOWN value_type.....";
   }
 }
 
-void SGDUpdater::UpdateV(real_t const* gV, SGDEntry* e) {
-  int nnz = e->nnz;
-  for (int i = 0; i < feat_dim; ++i) {
-    real_t sg = e->Z[i];
-    real_t vi = e->V[i];
-
-    // update sqrt_g
-    real_t gv = gV[i] + vi * param_.l2;
-    e->Z[i] = sqrt(sg * sg + gv * gv);
-    e->V[i] -= param_.lr * e->Z[i] * gv;
-   
-    // FTRL 
-    /*
-    e->Z[i + feat_dim] -= gv - (e->Z[i] - sg) / param_.lr * vi;
-
-    real_t z = e->Z[i + feat_dim];
-    real_t l1 = param_.l1;
-    if (z <= l1 && z >= - l1) {
-      e->V[i] = 0;
+SGDModelHeader SGDUpdater::Header(bool has_aux) const {
+  SGDModelHeader header;
+  header.has_aux = has_aux;
+  header.optimizer = param_.optimizer;
+  header.field_num = param_.field_num;
+  if (dims_.uniform()) {
+    header.V_dim = dims_.dim(0);
+  } else {
+    header.V_dim = 0;
+    header.V_dims = dims_.dims();
+  }
+  header.V_precision = param_.V_precision;
+  header.state_precision = param_.state_precision;
+  return header;
+}
+
+void SGDUpdater::SaveEntry(const SGDEntry& e, bool save_aux, dmlc::Stream* fo) const {
+  fo->Write(&e.size, sizeof(e.size));
+  int vp = param_.V_precision;
+  if (e.T) {
+    // the pending l2 decay is applied, so T needs not to be saved
+    std::vector<real_t> V(e.size);
+    CopyV(e, V.data());
+    std::vector<char> buf(e.size * PrecBytes(vp));
+    FromFloat(vp, V.data(), e.size, buf.data(), nullptr);
+    fo->Write(buf.data(), buf.size());
+  } else {
+    fo->Write(e.V, e.size * PrecBytes(vp));
+  }
+  if (save_aux) {
+    fo->Write(e.Z, StateSize(param_.optimizer) * PrecBytes(param_.state_precision));
+  }
+}
+
+void SGDUpdater::LoadEntry(dmlc::Stream* fi,
+                           const SGDModelHeader& header,
+                           SGDEntry* e) {
+  CHECK_EQ(fi->Read(&e->size, sizeof(e->size)), sizeof(e->size));
+  // a legacy model being dumped, whose V_dim and field_num are unknown
+  if (feat_dim == 0) feat_dim = e->size;
+  size_t V_bytes = e->size * PrecBytes(header.V_precision);
+  int stored = header.legacy() ? e->size * 2 : StateSize(header.optimizer);
+  size_t Z_bytes = header.has_aux ? stored * PrecBytes(header.state_precision) : 0;
+  std::vector<char> buf(V_bytes + Z_bytes);
+  CHECK_EQ(fi->Read(buf.data(), buf.size()), buf.size());
+  SetEntry(header, buf.data(), header.has_aux ? buf.data() + V_bytes : nullptr, e);
+}
+
+void SGDUpdater::SetEntry(const SGDModelHeader& header, const char* V_in,
+                          const char* Z, SGDEntry* e) const {
+  // release the arrays if it is loaded again
+  int size = e->size;
+  *e = SGDEntry();
+  e->size = size;
+  int vp = param_.V_precision;
+  std::vector<real_t> V(e->size);
+  ToFloat(header.V_precision, V_in, e->size, V.data());
+  e->V = new char[e->size * PrecBytes(vp)];
+  FromFloat(vp, V.data(), e->size, e->V, nullptr);
+  // values may be rounded to zero by a lower precision
+  ToFloat(vp, e->V, e->size, V.data());
+  e->nnz = CountNNZ(V.data(), e->size);
+  InitState(e, V.data());
+  if (!Z) return;
+  int n = StateSize(param_.optimizer);
+  int stored = header.legacy() ? e->size * 2 : StateSize(header.optimizer);
+  std::vector<real_t> aux(stored);
+  ToFloat(header.state_precision, Z, stored, aux.data());
+  if (header.legacy()) {
+    // legacy models store sqrt_g followed by an unused block
+    if (param_.optimizer == kAdaGrad) {
+      for (int i = 0; i < n; ++i) aux[i] *= aux[i];
+      FromFloat(param_.state_precision, aux.data(), n, e->Z, nullptr);
     } else {
-      real_t eta = (param_.lr_beta + e->Z[i]) / param_.lr + param_.l2;
-      e->V[i] = (z > 0 ? z - l1 : z + l1) / eta;
+      static std::once_flag warned;
+      std::call_once(warned, [] {
+          LOG(WARNING) << "the adagrad state of a legacy model is reset for another optimizer";
+        });
     }
-    */
+  } else if (header.optimizer == param_.optimizer) {
+    FromFloat(param_.state_precision, aux.data(), n, e->Z, nullptr);
+  } else {
+    static std::once_flag warned;
+    std::call_once(warned, [&header] {
+        LOG(WARNING) << "the state saved by optimizer " << header.optimizer
+                     << " is reset for another optimizer";
+      });
+  }
+}
+
+real_t* SGDUpdater::View(const char* base, int prec, int offset, int n,
+                         real_t* buf) const {
+  if (prec == kFP32) {
+    return const_cast<real_t*>(reinterpret_cast<const real_t*>(base)) + offset;
+  }
+  ToFloat(prec, base + offset * PrecBytes(prec), n, buf);
+  return buf;
+}
 
-    // update statistics
-    if (vi == 0 && e->V[i] != 0) {
-      ++ e->nnz;
-    } else if (vi != 0 && e->V[i] == 0) {
-      -- e->nnz;
+void SGDUpdater::Commit(char* base, int prec, int offset, int n, real_t* v) {
+  if (prec == kFP32) return;
+  char* dst = base + offset * PrecBytes(prec);
+  FromFloat(prec, v, n, dst, &rng_);
+  ToFloat(prec, dst, n, v);
+}
+
+void SGDUpdater::UpdateV(real_t const* gV, real_t const* mask, SGDEntry* e,
+                         real_t lr_scale) {
+  int nnz = e->nnz;
+  double penalty = 0;
+  real_t lr = param_.lr * lr_scale;
+  int vp = param_.V_precision, sp = param_.state_precision;
+  int max_dim = dims_.max_dim();
+  real_t* buf = scratch_.data();
+  real_t const* next = gV;
+  for (int f = 0; f < param_.field_num; ++f) {
+    int off = dims_.offset(f), V_dim = dims_.dim(f);
+    real_t const* g = gV + off;
+    // rows of fields not co-occurring with this feature have zero gradient,
+    // skip them and leave their l2 decay pending
+    if (mask) {
+      if (!FieldDims::HasRow(mask, f)) continue;
+      g = next;
+      next += V_dim;
+    } else {
+      bool zero = true;
+      for (int k = 0; k < V_dim; ++k) {
+        if (g[k] != 0) { zero = false; break; }
+      }
+      if (zero) continue;
+    }
+    real_t* v = View(e->V, vp, off, V_dim, buf);
+    // nnz counts the stored row, so take it out before the decay changes it
+    penalty -= Penalty(v, V_dim);
+    e->nnz -= CountNNZ(v, V_dim);
+    if (e->T) {
+      // apply the pending decay first
+      DecayRow(f, *e, v, buf + 3 * max_dim);
+      e->T[f] = e->step + 1;
     }
+    if (param_.optimizer == kFTRL) {
+      real_t* n = View(e->Z, sp, off, V_dim, buf + max_dim);
+      real_t* z = View(e->Z, sp, feat_dim + off, V_dim, buf + 2 * max_dim);
+      if (lr_scale != 1) {
+        // the lr of FTRL is in its state, so the gradient is scaled instead.
+        // FTRL never decays lazily, so the slot of DecayRow is free
+        real_t* sg = buf + 3 * max_dim;
+        for (int k = 0; k < V_dim; ++k) sg[k] = g[k] * lr_scale;
+        g = sg;
+      }
+      UpdateRowFTRL(V_dim, g, v, n, z);
+      Commit(e->Z, sp, off, V_dim, n);
+      Commit(e->Z, sp, feat_dim + off, V_dim, z);
+    } else if (param_.optimizer == kRowAdaGrad) {
+      // the V_dim elements of a row share the mean of their squared gradients
+      real_t gg = 0;
+      for (int k = 0; k < V_dim; ++k) {
+        real_t gv = g[k] + v[k] * param_.l2;
+        gg += gv * gv;
+      }
+      real_t* sg = View(e->Z, sp, f, 1, buf + max_dim);
+      *sg += gg / V_dim;
+      real_t eta = lr / sqrt(*sg);
+      for (int k = 0; k < V_dim; ++k) {
+        v[k] -= eta * (g[k] + v[k] * param_.l2);
+      }
+      Commit(e->Z, sp, f, 1, sg);
+    } else {
+      real_t* sg = View(e->Z, sp, off, V_dim, buf + max_dim);
+      for (int k = 0; k < V_dim; ++k) {
+        real_t gv = g[k] + v[k] * param_.l2;
+        sg[k] += gv * gv;
+        v[k] -= lr * gv / sqrt(sg[k]);
+      }
+      Commit(e->Z, sp, off, V_dim, sg);
+    }
+    Commit(e->V, vp, off, V_dim, v);
+    e->nnz += CountNNZ(v, V_dim);
+    penalty += Penalty(v, V_dim);
   }
+  ++ e->step;
+  if (e->freq < std::numeric_limits<uint32_t>::max()) ++ e->freq;
+  e->touched = now_;
+  Touch(e);
   new_w += (e->nnz - nnz);
+  penalty_ += penalty;
+}
+
+void SGDUpdater::DecayRow(int f, const SGDEntry& e, real_t* v, real_t* buf) const {
+  uint32_t k = e.step - e.T[f];
+  if (k == 0) return;
+  int V_dim = dims_.dim(f);
+  if (param_.optimizer == kRowAdaGrad) {
+    real_t decay = L2Decay(*View(e.Z, param_.state_precision, f, 1, buf), k);
+    for (int i = 0; i < V_dim; ++i) v[i] *= decay;
+  } else {
+    real_t const* sg = View(e.Z, param_.state_precision, dims_.offset(f), V_dim, buf);
+    for (int i = 0; i < V_dim; ++i) v[i] *= L2Decay(sg[i], k);
+  }
+}
+
+void SGDUpdater::CopyV(const SGDEntry& e, real_t* out, real_t* buf) const {
+  ToFloat(param_.V_precision, e.V, e.size, out);
+  if (!e.T) return;
+  if (!buf) buf = scratch_.data() + 3 * dims_.max_dim();
+  for (int f = 0; f < param_.field_num; ++f) {
+    DecayRow(f, e, out + dims_.offset(f), buf);
+  }
+}
+
+void SGDUpdater::UpdateRowFTRL(int dim, real_t const* g, real_t* v,
+                               real_t* n, real_t* z) {
+  real_t lr = param_.lr, beta = param_.lr_beta;
+  real_t l1 = param_.l1, l2 = param_.l2;
+  // branch free, so that it is vectorized. |z| <= l1 gives an exact zero
+#pragma omp simd
+  for (int k = 0; k < dim; ++k) {
+    real_t gk = g[k];
+    real_t sqrt_n = sqrtf(n[k]);
+    real_t nk = n[k] + gk * gk;
+    real_t sqrt_nk = sqrtf(nk);
+    z[k] += gk - (sqrt_nk - sqrt_n) / lr * v[k];
+    n[k] = nk;
+    real_t shrink = fmaxf(fabsf(z[k]) - l1, 0.0f);
+    v[k] = - copysignf(shrink, z[k]) / ((beta + sqrt_nk) / lr + l2) + 0.0f;
+  }
 }
 
-void SGDUpdater::InitV(SGDEntry* e) {
-  e->V = new real_t[feat_dim];
-  e->Z = new real_t[feat_dim*2];
-  for (int i = 0; i < feat_dim; ++i) {
-    e->V[i] = coef * distribution(generator);
-    if (e->V[i] != 0) e->nnz += 1;
+void SGDUpdater::InitState(SGDEntry* e, real_t const* V) const {
+  int n = StateSize(param_.optimizer);
+  std::vector<real_t> Z(n);
+  if (lazy_l2()) {
+    e->T = new uint32_t[param_.field_num];
+    std::fill(e->T, e->T + param_.field_num, 0);
   }
-  memset(e->Z, 1.0, feat_dim * sizeof(real_t));
-  memset(e->Z + feat_dim, 0, feat_dim * sizeof(real_t));
+  if (param_.optimizer == kFTRL) {
+    // n = 0, and z is chosen such that the closed form gives back V
+    real_t eta = param_.lr_beta / param_.lr + param_.l2;
+    for (int i = 0; i < feat_dim; ++i) {
+      real_t vi = V[i];
+      Z[feat_dim + i] = vi == 0 ? 0 : - vi * eta - copysignf(param_.l1, vi);
+    }
+  } else {
+    // accumulators start from 1 to bound the first steps
+    std::fill(Z.begin(), Z.end(), 1.0f);
+  }
+  e->Z = new char[n * PrecBytes(param_.state_precision)];
+  FromFloat(param_.state_precision, Z.data(), n, e->Z, nullptr);
+}
+
+void SGDUpdater::InitialV(feaid_t key, real_t* V) const {
+  int vp = param_.V_precision;
+  for (int f = 0; f < param_.field_num; ++f) {
+    real_t scale = param_.V_init_scale / sqrt(dims_.dim(f));
+    for (int i = dims_.offset(f); i < dims_.offset(f+1); ++i) {
+      V[i] = scale * HashUniform(param_.seed, key, i);
+    }
+  }
+  if (vp == kFP32) return;
+  // round as it would be stored, so that it does not change on allocation
+  std::vector<char> buf(feat_dim * PrecBytes(vp));
+  FromFloat(vp, V, feat_dim, buf.data(), nullptr);
+  ToFloat(vp, buf.data(), feat_dim, V);
+}
+
+void SGDUpdater::InitV(feaid_t key, SGDEntry* e) {
+  std::vector<real_t> V(feat_dim);
+  InitialV(key, V.data());
+  AllocV(V.data(), e);
+}
+
+void SGDUpdater::ReadV(feaid_t key, const SGDEntry& e, real_t* out) const {
+  if (e.V) {
+    CopyV(e, out);
+  } else if (e.released()) {
+    std::fill(out, out + feat_dim, 0);
+  } else {
+    // admitted but not updated yet
+    InitialV(key, out);
+  }
+}
+
+void SGDUpdater::ReadRows(feaid_t key, const SGDEntry& e, real_t const* mask,
+                          real_t* out) const {
+  std::vector<real_t> V;
+  if (!e.V) {
+    // zero if released
+    V.resize(feat_dim);
+    if (!e.released()) InitialV(key, V.data());
+  }
+  int vp = param_.V_precision;
+  real_t* buf = scratch_.data() + 3 * dims_.max_dim();
+  for (int f = 0; f < param_.field_num; ++f) {
+    if (!FieldDims::HasRow(mask, f)) continue;
+    int off = dims_.offset(f), dim = dims_.dim(f);
+    if (e.V) {
+      ToFloat(vp, e.V + off * PrecBytes(vp), dim, out);
+      if (e.T) DecayRow(f, e, out, buf);
+    } else {
+      memcpy(out, V.data() + off, dim * sizeof(real_t));
+    }
+    out += dim;
+  }
+}
+
+void SGDUpdater::AllocV(real_t const* V, SGDEntry* e) {
+  int vp = param_.V_precision;
+  Account(*e, -1);
+  e->V = new char[feat_dim * PrecBytes(vp)];
+  FromFloat(vp, V, feat_dim, e->V, nullptr);
+  // as stored, which may be rounded
+  std::vector<real_t> stored(feat_dim);
+  ToFloat(vp, e->V, feat_dim, stored.data());
+  e->nnz = CountNNZ(stored.data(), feat_dim);
+  InitState(e, stored.data());
   e->size = feat_dim;
-  new_w += e->nnz;
+  e->touched = now_;
+  Touch(e);
+  Tally(*e, 1);
+  Account(*e, 1);
+}
+
+void SGDUpdater::Evict() {
+  EvictLocked();
+  // the evicted records are only buffered by cold_, they are written and the
+  // file is compacted without blocking the pushes and pulls
+  if (cold_.is_open()) {
+    cold_.Flush();
+    cold_.Compact();
+  }
+}
+
+void SGDUpdater::EvictLocked() {
+  std::lock_guard<std::mutex> lk(mu_);
+  now_ = static_cast<uint32_t>(dmlc::GetTime() - start_time_);
+  size_t budget = static_cast<size_t>(param_.max_mem) << 20;
+  bool ttl = param_.evict_policy == kEvictTTL;
+  std::vector<feaid_t> victims;
+  size_t freed = 0;
+  if (ttl) {
+    table_->ForEach([&](feaid_t key, const SGDEntry& e) {
+        if (now_ - e.touched > static_cast<uint32_t>(param_.evict_ttl)) {
+          victims.push_back(key);
+          freed += EntryBytes(e);
+        }
+      });
+  }
+  if (mem_bytes_ - freed > budget && table_->size() > victims.size()) {
+    // find the score threshold below which the entries are evicted
+    auto score = [ttl](const SGDEntry& e) { return ttl ? e.touched : e.freq; };
+    size_t target = budget / 10 * 9;
+    size_t remain = mem_bytes_ - freed;
+    std::vector<uint32_t> scores;
+    scores.reserve(table_->size());
+    table_->ForEach([&](feaid_t key, const SGDEntry& e) { scores.push_back(score(e)); });
+    size_t k = static_cast<size_t>(static_cast<double>(remain - target) /
+                                   remain * scores.size());
+    k = std::min(k, scores.size() - 1);
+    std::nth_element(scores.begin(), scores.begin() + k, scores.end());
+    uint32_t threshold = scores[k];
+    uint32_t ttl_sec = static_cast<uint32_t>(param_.evict_ttl);
+    table_->ForEach([&](feaid_t key, const SGDEntry& e) {
+        // skip the ones already picked by the ttl pass
+        if (remain <= target || score(e) > threshold ||
+            (ttl && now_ - e.touched > ttl_sec)) return;
+        victims.push_back(key);
+        remain -= EntryBytes(e);
+      });
+    // aging, so that entries which were hot long ago can be evicted later
+    if (!ttl) {
+      table_->ForEach([](feaid_t key, SGDEntry* e) { e->freq >>= 1; });
+    }
+  }
+  for (feaid_t key : victims) EvictEntry(key, table_->Find(key));
+  table_->Maintain();
+  if (victims.size()) {
+    num_evicted_ += victims.size();
+    LOG(INFO) << "evicted " << victims.size() << " entries, " << table_->size()
+              << " entries use " << (mem_bytes_ >> 20) << " MB";
+    if (cold_.is_open()) {
+      LOG(INFO) << cold_.size() << " entries in the cold tier use "
+                << (cold_.FileSize() >> 20) << " MB on disk";
+    }
+  }
+}
+
+void SGDUpdater::FindAll(const SArray<feaid_t>& keys, SGDEntry** entries) {
+  table_->FindSorted(keys.data(), keys.size(), entries);
+  if (!cold_.is_open() && !lazy_) return;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (!entries[i]) entries[i] = Find(keys[i]);
+  }
+}
+
+SGDEntry* SGDUpdater::Find(feaid_t key) {
+  SGDEntry* e = table_->Find(key);
+  if (e) return e;
+  // the entries of a snapshot being loaded lazily are never in the cold tier
+  if (lazy_ && (e = FaultIn(key))) return e;
+  if (!cold_.is_open()) return nullptr;
+  std::string rec;
+  if (!cold_.Get(key, &rec)) return nullptr;
+  cold_.Erase(key);
+  e = table_->Insert(key);
+  DecodeEntry(rec, e);
+  // count at least once so it will not be evicted again immediately
+  if (e->freq == 0) e->freq = 1;
+  e->touched = now_;
+  if (dirty_cold_.erase(key)) Touch(e);
+  Account(*e, 1);
+  return e;
+}
+
+void SGDUpdater::EvictEntry(feaid_t key, SGDEntry* e) {
+  // an entry without V starts from the initial value again on its gradient
+  if (!cold_.is_open() || e->V == nullptr) {
+    Erase(key, e);
+    return;
+  }
+  std::string rec;
+  EncodeEntry(*e, &rec);
+  cold_.Put(key, rec);
+  if (chain_ && Dirty(*e)) dirty_cold_.insert(key);
+  // the weights are still in the model, so new_w and penalty_ are unchanged
+  Account(*e, -1);
+  table_->Erase(key);
+}
+
+void SGDUpdater::EncodeEntry(const SGDEntry& e, std::string* rec) const {
+  rec->clear();
+  dmlc::MemoryStringStream ms(rec);
+  SaveEntry(e, true, &ms);
+  // the staleness and the eviction need them back on promotion
+  ms.Write(&e.step, sizeof(e.step));
+  ms.Write(&e.freq, sizeof(e.freq));
+}
+
+void SGDUpdater::DecodeEntry(const std::string& rec, SGDEntry* e) {
+  std::string copy = rec;
+  dmlc::MemoryStringStream ms(&copy);
+  LoadEntry(&ms, Header(true), e);
+  CHECK_EQ(ms.Read(&e->step, sizeof(e->step)), sizeof(e->step));
+  CHECK_EQ(ms.Read(&e->freq, sizeof(e->freq)), sizeof(e->freq));
+  // the pending decay was applied when it was encoded
+  if (e->T) std::fill(e->T, e->T + param_.field_num, e->step);
 }
 
 }  // namespace difacto
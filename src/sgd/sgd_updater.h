@@ -8,133 +8,297 @@
 #include <vector>
 #include <mutex>
 #include <limits>
-#include <random>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <unordered_set>
 #include "dmlc/io.h"
 #include "difacto/updater.h"
 #include "./sgd_param.h"
 #include "./sgd_utils.h"
+#include "common/count_min_sketch.h"
+#include "common/space_saving.h"
+#include "./cold_store.h"
+#include "./update_log.h"
+#include "./grad_codec.h"
+#include "./sgd_table.h"
+#include "./sgd_snapshot.h"
+#include "common/field_dims.h"
+#include "common/hash.h"
 namespace difacto {
 
 /**
- * \brief the weight entry for one feature
+ * \brief the header of a saved model
+ *
+ * models saved before the header was introduced start with a bool has_aux
+ * instead, whose first byte can never be equal to the first byte of kMagic.
  */
-struct SGDEntry {
- public:
-  SGDEntry() { }
-  ~SGDEntry() { delete [] V; delete [] Z;}
-  /** \brief the number of appearence of this feature in the data so far */
-  real_t fea_cnt = 0;
-  /** \brief V and its aux data */
-  real_t *V = nullptr;
-  real_t *Z = nullptr; // cg and z
-  /** \brief size of V */
-  int size = 0;
-  int nnz = 0;
-  /** \brief wether entry is empty */
-  inline bool empty() const { return nnz == 0; }
-  /** \brief save this entry */
-  void SaveEntry(bool save_aux, dmlc::Stream* fo) const {
-    if (size == 0) return;
-    fo->Write(&size, sizeof(size));
-    // save V
-    fo->Write(V, sizeof(real_t)*size);
-    if (save_aux) fo->Write(Z, sizeof(real_t)*size*2);
-  }
-  /** \brief load this entry */
-  void LoadEntry(dmlc::Stream* fi, bool has_aux) {
-    CHECK_EQ(fi->Read(&size, sizeof(size)), sizeof(size));
-    // load V
-    V = new real_t[size];
-    Z = new real_t[size * 2]; // cg and z
-    CHECK_EQ(fi->Read(V, sizeof(real_t)*size), sizeof(real_t)*size);
-    for (int i = 0; i < size; ++i) { if (V[i] != 0) nnz += 1; }
-    if (has_aux) {
-      CHECK_EQ(fi->Read(Z, sizeof(real_t)*size*2), sizeof(real_t)*size*2);
-    } else {
-      memset(Z, 0, sizeof(real_t)*size*2);
+struct SGDModelHeader {
+  static const uint32_t kMagic = 0x33464644;
+  /** \brief the magic of models saved before the precisions were recorded */
+  static const uint32_t kMagicFP32 = 0x32464644;
+  /** \brief the magic of compressed models, whose header has the codec */
+  static const uint32_t kMagicBlocks = 0x34464644;
+  uint32_t magic = kMagic;
+  /** \brief whether the optimizer state is saved */
+  bool has_aux = false;
+  /** \brief the optimizer which produced the saved state */
+  int optimizer = kAdaGrad;
+  /** \brief the dim of all fields, or 0 if the fields have their own V_dims */
+  int V_dim = 0;
+  int field_num = 0;
+  std::vector<int> V_dims;
+  /** \brief the precisions V and the state are saved in */
+  int V_precision = kFP32;
+  int state_precision = kFP32;
+  /** \brief the codec of a compressed model, see \ref SGDModelCodec */
+  int codec = kCodecNone;
+
+  void Save(dmlc::Stream* fo) const {
+    fo->Write(&magic, sizeof(magic));
+    fo->Write(&has_aux, sizeof(has_aux));
+    fo->Write(&optimizer, sizeof(optimizer));
+    fo->Write(&V_dim, sizeof(V_dim));
+    fo->Write(&field_num, sizeof(field_num));
+    fo->Write(&V_precision, sizeof(V_precision));
+    fo->Write(&state_precision, sizeof(state_precision));
+    if (magic == kMagicBlocks) fo->Write(&codec, sizeof(codec));
+    if (V_dim == 0) fo->Write(V_dims.data(), sizeof(int) * field_num);
+  }
+  /**
+   * \brief load the header, returns false if fi is empty
+   *
+   * a legacy model only contains has_aux, whose state is the adagrad one
+   * followed by an unused block with the same length
+   */
+  bool Load(dmlc::Stream* fi) {
+    uint8_t first;
+    if (fi->Read(&first, 1) != 1) return false;
+    if (first <= 1) {
+      has_aux = first; magic = 0; optimizer = kAdaGrad;
+      return true;
     }
+    magic = first;
+    uint8_t rest[3];
+    CHECK_EQ(fi->Read(rest, 3), 3U);
+    for (int i = 0; i < 3; ++i) magic |= static_cast<uint32_t>(rest[i]) << (8 * (i+1));
+    CHECK(magic == kMagic || magic == kMagicFP32 || magic == kMagicBlocks)
+        << "unknown model format";
+    CHECK_EQ(fi->Read(&has_aux, sizeof(has_aux)), sizeof(has_aux));
+    CHECK_EQ(fi->Read(&optimizer, sizeof(optimizer)), sizeof(optimizer));
+    CHECK_EQ(fi->Read(&V_dim, sizeof(V_dim)), sizeof(V_dim));
+    CHECK_EQ(fi->Read(&field_num, sizeof(field_num)), sizeof(field_num));
+    if (magic != kMagicFP32) {
+      CHECK_EQ(fi->Read(&V_precision, sizeof(V_precision)), sizeof(V_precision));
+      CHECK_EQ(fi->Read(&state_precision, sizeof(state_precision)),
+               sizeof(state_precision));
+      if (magic == kMagicBlocks) {
+        CHECK_EQ(fi->Read(&codec, sizeof(codec)), sizeof(codec));
+      }
+      if (V_dim == 0) {
+        V_dims.resize(field_num);
+        size_t n = sizeof(int) * field_num;
+        CHECK_EQ(fi->Read(V_dims.data(), n), n);
+      }
+    }
+    return true;
+  }
+  /** \brief the dims of all fields */
+  std::vector<int> dims() const {
+    return V_dim ? std::vector<int>(field_num, V_dim) : V_dims;
+  }
+  /** \brief whether this is a legacy model without header */
+  bool legacy() const {
+    return magic != kMagic && magic != kMagicFP32 && magic != kMagicBlocks;
   }
 };
+
 /**
  * \brief sgd updater
  *
- * - w is updated by FTRL, which is a smooth version of adagrad works well with
- *   the l1 regularizer
- * - V is updated by adagrad
+ * - V is updated by adagrad, either with one accumulator per element or one per
+ *   (feature, field) row, or by FTRL-proximal, see \ref SGDOptimizer
+ * - an admitted feature gets an entry without V, whose initial value is
+ *   synthesized by \ref InitialV on pull. V is allocated on the first gradient
+ * - with tier_threshold, features counted less share hashed buckets, and get
+ *   private entries once they reach it
+ * - with FTRL, an entry whose V becomes entirely zero releases V but keeps
+ *   its state. it is served as zero, and FTRL goes on from its state on its
+ *   next gradient
+ * - with max_mem, cold entries are evicted by a background thread once the
+ *   memory budget is reached, see \ref SGDEvictPolicy. an evicted feature is
+ *   told by its count, and starts from the initial value again
+ * - with cold_path, evicted entries are moved into a \ref ColdStore on the
+ *   local disk and moved back on their next access
+ * - the entries are held by a hash table or sorted arrays, see \ref SGDTable
+ * - V and the state can be stored in 16 bits, see \ref SGDPrecision. the rows
+ *   being updated are converted into fp32 and rounded back stochastically
+ * - the memory and the entry counts are maintained incrementally, and sent to
+ *   the scheduler with the most pushed keys, see \ref sgd::ServerStats
+ * - a checkpoint can be a delta of a snapshot, which has only the entries
+ *   changed since the previous checkpoint, see \ref SaveDelta
  */
 class SGDUpdater : public Updater {
  public:
-  SGDUpdater() {}
-  virtual ~SGDUpdater() {}
+  /** \brief the reserved key in a saved model followed by the buckets */
+  static const feaid_t kBucketKey = static_cast<feaid_t>(-1);
+
+  /** \brief the default param, so that a model can be loaded without Init */
+  SGDUpdater() { param_.InitAllowUnknown(KWArgs()); }
+  virtual ~SGDUpdater() {
+    done_ = true;
+    if (evict_thread_) evict_thread_->join();
+    if (ckpt_thread_) ckpt_thread_->join();
+    if (load_thread_) load_thread_->join();
+  }
 
   KWArgs Init(const KWArgs& kwargs) override;
 
-  void Load(dmlc::Stream* fi) override {
-    bool has_aux;
-    feaid_t key;
-    int64_t loaded = 0;
-    if (fi->Read(&has_aux, sizeof(bool)) != sizeof(bool)) return;
-    while (true) {
-      if (fi->Read(&key, sizeof(feaid_t)) != sizeof(feaid_t)) break;
-      model_[key].LoadEntry(fi, has_aux);
-      loaded ++ ;
-      new_w += model_[key].nnz;
-    }
-    LOG(INFO) << "loaded " << loaded << " kv pairs";
-  };
-
-  void Save(bool save_aux, dmlc::Stream *fo) const override {
-    int64_t saved = 0;
-    fo->Write(&save_aux, sizeof(bool));
-    for (const auto& it : model_) {
-      if (it.second.empty()) continue;
-      fo->Write(&it.first, sizeof(feaid_t));
-      it.second.SaveEntry(save_aux, fo);
-      saved ++ ;
-    }
-    LOG(INFO) << "saved " << saved << " kv pairs";
-  };
-
-  void Dump(bool dump_aux, bool need_reverse, dmlc::Stream *fo) const override {
-    int64_t dumped = 0;
-    dmlc::ostream os(fo);
-    for (const auto& it : model_) {
-      if (it.second.empty()) continue;
-      auto key = need_reverse ? ReverseBytes(it.first) : it.first;
-      os << key;
-
-      /** \ here dump entry to avoid passing os */
-      os << '\t' << it.second.size;
-      // dump V
-      int n = it.second.size;
-      for (int i = 0; i < n; ++i) {
-        os << '\t' << it.second.V[i];
-      }
-      if (dump_aux) {
-        for (int i = 0; i < n*2; ++i) {
-          os << '\t' << it.second.Z[i];
-        }
-      }
+  void Load(dmlc::Stream* fi) override;
 
-      os << '\n';
-      dumped ++ ;
-    }
-    LOG(INFO) << "dumped " << dumped << " kv pairs";
-  };
-
-  std::string Get_report() override {
-    sgd::Progress report_prog; report_prog.nnz_w = new_w;
-    std::string rets;
-    report_prog.SerializeToString(&rets);
-    new_w = 0;
-    return rets;
-  };
+  /**
+   * \brief load only the keys in [begin, end). the shared buckets are loaded
+   * only if buckets_too, or alone by [kBucketKey, kBucketKey). it can be
+   * called by several threads at the same time
+   */
+  void Load(dmlc::Stream* fi, feaid_t begin, feaid_t end, bool buckets_too);
+
+  void Save(bool save_aux, dmlc::Stream *fo) const override;
+
+  void Dump(bool dump_aux, bool need_reverse, dmlc::Stream *fo) const override;
+
+  /**
+   * \brief dump the entries in text, ordered by keys, into fos. the keys are
+   * split into fos.size() ranges, each of which is written into its stream by
+   * one thread. a single stream is written in chunks formatted by
+   * num_threads threads. the entries in the cold tier are included, but the
+   * shared buckets are not, as they have no keys
+   */
+  void DumpParts(bool dump_aux, bool need_reverse,
+                 const std::vector<dmlc::Stream*>& fos) const;
+
+  /**
+   * \brief save the values in blocks encoded by codec, see \ref
+   * SGDModelCodec. the blocks are encoded by num_threads threads
+   */
+  void SaveCompressed(bool save_aux, int codec, dmlc::Stream* fo) const;
+
+  /**
+   * \brief save into a file in format, see \ref SGDModelFormat. chain is the
+   * one of a snapshot, see \ref SaveSnapshot
+   */
+  void SaveModel(const std::string& filename, int format, bool save_aux,
+                 uint64_t chain = 0);
+
+  /**
+   * \brief save into a local snapshot, see \ref SGDSnapshot. the entries are
+   * written by num_threads threads. it starts a new chain of deltas, and
+   * removes the deltas of the previous one. the chain is chosen by the
+   * caller, such as the scheduler, or by the time if 0
+   */
+  void SaveSnapshot(const std::string& filename, bool save_aux, uint64_t chain = 0);
+
+  /**
+   * \brief save the entries changed and the keys erased since the last
+   * checkpoint into the next delta of the snapshot filename, see \ref
+   * DeltaName, and remove the later deltas left by a previous run. a full
+   * snapshot is saved instead if filename has no chain yet. if chain is
+   * given, the delta should be the seq-th of chain, and a full snapshot of
+   * chain is saved otherwise
+   */
+  void SaveDelta(const std::string& filename, bool save_aux,
+                 uint64_t chain = 0, uint32_t seq = 0);
+
+  /**
+   * \brief take checkpoints into the snapshot filename in the background,
+   * every interval minutes or every batches gradient pushes if > 0. every
+   * num_deltas + 1 checkpoints, one is full and the others are deltas
+   */
+  void SetCheckpoint(const std::string& filename, bool save_aux,
+                     int num_deltas, int interval, int batches);
+
+  /**
+   * \brief load the keys in [begin, end) of a snapshot or a delta, whose
+   * entries are decoded by num_threads threads. if all keys are loaded and
+   * follow_chain, a delta should follow the last file loaded, and the file
+   * becomes the last one. the buckets are loaded then, or alone by
+   * [kBucketKey, kBucketKey)
+   */
+  void LoadSnapshot(const std::string& filename,
+                    feaid_t begin = 0, feaid_t end = kBucketKey,
+                    bool follow_chain = true);
+
+  /**
+   * \brief load the keys in [begin, end) of a model file, either a stream, or
+   * a snapshot followed by the deltas of its chain. without follow_chain, the
+   * file is one of several, and the chain of this server is kept, see
+   * \ref LoadSnapshot. if chain is given, the snapshot should be of chain,
+   * and only its deltas up to the seq-th are loaded
+   */
+  void LoadModel(const std::string& filename,
+                 feaid_t begin = 0, feaid_t end = kBucketKey,
+                 bool follow_chain = true, uint64_t chain = 0, uint32_t seq = 0);
+
+  /**
+   * \brief load the keys in [begin, end) of the model files saved by all
+   * servers, such as into a different number of servers. the files are read
+   * by up to num_threads threads, and the parts of a snapshot or a compressed
+   * model out of the range are skipped by its sorted keys. the shared
+   * buckets are taken from the first file. chain and seq are as \ref LoadModel
+   */
+  void LoadShards(const std::vector<std::string>& files, feaid_t begin, feaid_t end,
+                  uint64_t chain = 0, uint32_t seq = 0);
+
+  /**
+   * \brief load a model file like \ref LoadModel, but return once a snapshot
+   * is opened. an entry is loaded on its first access, while a background
+   * thread loads the others. saving and evaluating wait until all are loaded
+   */
+  void LoadLazy(const std::string& filename);
+
+  /**
+   * \brief log the updates since the last checkpoint saved into the snapshot
+   * filename, see \ref Recover. a log starts when a checkpoint starts
+   */
+  void StartUpdateLog(const std::string& filename);
+
+  /**
+   * \brief recover from the snapshot filename and the updates logged since its
+   * last checkpoint, such as after the server was killed, and go on logging.
+   * the replayed updates are applied but not counted again towards the
+   * periodic checkpoints or the decay of the counts. save_aux is used if a
+   * new checkpoint is needed
+   */
+  void Recover(const std::string& filename, bool save_aux);
+
+  /** \brief the log of the updates after the checkpoint (chain, seq) */
+  static std::string LogName(const std::string& filename, uint64_t chain, uint32_t seq) {
+    return filename + ".log-" + std::to_string(chain) + "-" + std::to_string(seq);
+  }
+
+  /** \brief the name of the k-th delta of a snapshot */
+  static std::string DeltaName(const std::string& filename, uint32_t k) {
+    return filename + ".delta-" + std::to_string(k);
+  }
+
+  /**
+   * \brief the progress since the last report, followed by the \ref
+   * sgd::ServerStats every stats_interval seconds
+   */
+  std::string Get_report() override;
   
   void Get(const SArray<feaid_t>& fea_ids,
            int value_type,
            SArray<real_t>* weights,
            SArray<int>* val_lens) override;
 
+  /** \brief masks has mask_size slots for each key, see \ref FieldDims::PackRows */
+  void GetRows(const SArray<feaid_t>& fea_ids,
+               int value_type,
+               const SArray<real_t>& masks,
+               SArray<real_t>* weights,
+               SArray<int>* val_lens) override;
 
   void Update(const SArray<feaid_t>& fea_ids,
               int value_type,
@@ -144,30 +308,437 @@ class SGDUpdater : public Updater {
   void Evaluate(sgd::Progress* prog) const;
 
   const SGDUpdaterParam& param() const { return param_; }
+  /** \brief the layout of the field rows of V */
+  const FieldDims& dims() const { return dims_; }
 
  private:
+  /**
+   * \brief the length of the optimizer state of an entry
+   *
+   * - adagrad: one accumulator per element
+   * - rowwise adagrad: one accumulator per field row
+   * - ftrl: the accumulated squared gradients n followed by z
+   */
+  inline int StateSize(int optimizer) const {
+    if (optimizer == kRowAdaGrad) return param_.field_num;
+    if (optimizer == kFTRL) return feat_dim * 2;
+    return feat_dim;
+  }
+
+  /** \brief the bytes of an element stored in precision prec */
+  static inline int PrecBytes(int prec) { return prec == kFP32 ? 4 : 2; }
+
+  /** \brief the bytes used by an entry, including the table overhead */
+  inline size_t EntryBytes(const SGDEntry& e) const {
+    size_t bytes = table_->EntryOverhead();
+    if (e.V) bytes += e.size * PrecBytes(param_.V_precision);
+    if (e.Z) bytes += StateSize(param_.optimizer) * PrecBytes(param_.state_precision);
+    if (e.T) bytes += sizeof(uint32_t) * param_.field_num;
+    return bytes;
+  }
+
+  /** \brief the l2 and l1 penalty of n values of V */
+  inline double Penalty(real_t const* v, int n) const {
+    bool l1 = param_.optimizer == kFTRL && param_.l1 != 0;
+    if (param_.l2 == 0 && !l1) return 0;
+    double p = 0;
+    for (int i = 0; i < n; ++i) {
+      p += .5 * param_.l2 * v[i] * v[i];
+      if (l1) p += param_.l1 * fabs(v[i]);
+    }
+    return p;
+  }
+  /** \brief the penalty of the stored V of an entry */
+  double Penalty(const SGDEntry& e) const;
+  /**
+   * \brief add the nnz and the penalty of an entry into new_w and penalty_,
+   * or remove them with sign = -1
+   */
+  inline void Tally(const SGDEntry& e, int sign) {
+    new_w += sign * e.nnz;
+    penalty_ += sign * Penalty(e);
+  }
+
+  /**
+   * \brief add the memory of an entry into mem_bytes_ and stats_, or remove
+   * it with sign = -1
+   */
+  inline void Account(const SGDEntry& e, int sign) {
+    size_t V = 0, state = 0, header = EntryBytes(e);
+    if (e.V) V = e.size * PrecBytes(param_.V_precision);
+    if (e.Z) state = StateSize(param_.optimizer) * PrecBytes(param_.state_precision);
+    header -= V + state;
+    if (sign > 0) {
+      mem_bytes_ += header + V + state;
+      stats_.header_bytes += header; stats_.V_bytes += V; stats_.state_bytes += state;
+      stats_.num_V += e.V != nullptr;
+    } else {
+      mem_bytes_ -= header + V + state;
+      stats_.header_bytes -= header; stats_.V_bytes -= V; stats_.state_bytes -= state;
+      stats_.num_V -= e.V != nullptr;
+    }
+  }
 
-  /** \brief update V by adagrad */
-  void UpdateV(real_t const* gV, SGDEntry* e);
+  /**
+   * \brief find an entry, which is moved back from the cold tier if there.
+   * returns nullptr if not found
+   */
+  SGDEntry* Find(feaid_t key);
 
-  /** \brief init V */
-  void InitV(SGDEntry* e);
+  /** \brief find the entries of the keys of a request by \ref SGDTable::FindSorted */
+  void FindAll(const SArray<feaid_t>& keys, SGDEntry** entries);
+
+  /** \brief evict an entry into the cold tier, or drop it if no cold tier */
+  void EvictEntry(feaid_t key, SGDEntry* e);
+
+  /** \brief serialize an entry with its state, step and freq into a cold tier record */
+  void EncodeEntry(const SGDEntry& e, std::string* rec) const;
+
+  /** \brief deserialize a cold tier record */
+  void DecodeEntry(const std::string& rec, SGDEntry* e);
+
+  /** \brief erase an entry */
+  inline void Erase(feaid_t key, SGDEntry* e) {
+    Preserve(key, *e);
+    // an entry without V is never saved
+    if (chain_ && e->V) erased_.push_back(key);
+    Account(*e, -1);
+    Tally(*e, -1);
+    table_->Erase(key);
+  }
+
+  /**
+   * \brief release V of an entry which became all zero, and keep its state.
+   * it is not saved, as an entry without V
+   */
+  inline void Release(feaid_t key, SGDEntry* e) {
+    Preserve(key, *e);
+    if (chain_) erased_.push_back(key);
+    Account(*e, -1);
+    delete [] e->V;
+    e->V = nullptr;
+    Account(*e, 1);
+  }
+
+  /** \brief mark an entry as changed since the last checkpoint */
+  inline void Touch(SGDEntry* e) { e->stamp = num_ckpts_ + 1; }
+  /** \brief whether an entry is changed since the last checkpoint */
+  inline bool Dirty(const SGDEntry& e) const { return e.stamp > num_ckpts_; }
+
+  /**
+   * \brief save a snapshot, with all entries, or only the changed ones and the
+   * erased keys if delta. a full snapshot starts chain, or a new one if 0
+   *
+   * the keys are taken under the lock, then the entries are written in chunks
+   * with the lock released between them. an entry changed or erased before
+   * it is written is written first by \ref Preserve, so the snapshot is the
+   * state when the keys were taken, while the requests are still served
+   */
+  void WriteSnapshot(const std::string& filename, bool save_aux, bool delta,
+                     uint64_t chain = 0);
+
+  /** \brief write an entry into the snapshot being written before changing it */
+  inline void Preserve(feaid_t key, const SGDEntry& e) {
+    if (cow_snap_) CopyOnWrite(key, e);
+  }
+  void CopyOnWrite(feaid_t key, const SGDEntry& e);
+
+  /** \brief write an entry into the i-th slot of sec, see \ref CopyV for buf */
+  void PutEntry(SGDSnapshot* snap, const SGDSnapshotHeader::Section& sec,
+                size_t i, const SGDEntry& e, real_t* buf) const;
+
+  /** \brief write a cold record into the i-th slot of sec */
+  void PutRecord(SGDSnapshot* snap, const SGDSnapshotHeader::Section& sec,
+                 size_t i, const std::string& rec) const;
+
+  /** \brief start a checkpoint in ckpt_thread_ unless one is running */
+  void StartCheckpoint();
+
+  /**
+   * \brief evict entries once the memory budget is reached
+   *
+   * it frees memory until 90% of the budget is used. it is called by
+   * evict_thread_ out of the request path.
+   */
+  void Evict();
+  /** \brief pick and evict the entries with mu_ held, see \ref Evict */
+  void EvictLocked();
+
+  /** \brief allocate and init the optimizer state of an entry given its V */
+  void InitState(SGDEntry* e, real_t const* V) const;
+
+  /** \brief the header describing how this updater saves entries */
+  SGDModelHeader Header(bool has_aux) const;
+
+  /**
+   * \brief use the configuration of a saved model if not inited, and check
+   * that the model matches it
+   */
+  void AdoptHeader(const SGDModelHeader& header);
+
+  /** \brief save the size, V with the pending l2 decay applied, and the state */
+  void SaveEntry(const SGDEntry& e, bool save_aux, dmlc::Stream* fo) const;
+
+  /**
+   * \brief load an entry saved with header, converted into the precisions of
+   * this updater
+   *
+   * the state is reset if it was not saved or saved by another optimizer
+   */
+  void LoadEntry(dmlc::Stream* fi, const SGDModelHeader& header, SGDEntry* e);
+
+  /**
+   * \brief set an entry with e->size from V and the state Z saved with
+   * header, see \ref LoadEntry. Z is nullptr if the state was not saved. it
+   * is thread-safe
+   */
+  void SetEntry(const SGDModelHeader& header, const char* V, const char* Z,
+                SGDEntry* e) const;
+
+  /**
+   * \brief returns base[offset, offset+n) as real_t
+   *
+   * for fp32 it points into base, otherwise the elements are converted into
+   * buf. the result is written back by \ref Commit
+   */
+  real_t* View(const char* base, int prec, int offset, int n, real_t* buf) const;
+
+  /**
+   * \brief write back a row returned by \ref View with stochastic rounding,
+   * and set v to the stored values
+   */
+  void Commit(char* base, int prec, int offset, int n, real_t* v);
+
+  /**
+   * \brief update V by the optimizer
+   * @param gV the gradient of V, or only the rows in mask if mask is given
+   * @param mask a row mask, see \ref FieldDims::PackRows
+   * @param lr_scale scales the learning rate, see SGDUpdaterParam::staleness_aware
+   */
+  void UpdateV(real_t const* gV, real_t const* mask, SGDEntry* e, real_t lr_scale = 1);
+
+  /**
+   * \brief whether l2 is applied lazily
+   *
+   * with adagrad, a row with zero gradient would still decay by l2. the
+   * decay is postponed until the row is touched again, or approximated on
+   * read, with the accumulator fixed at its current value. FTRL has l2 in
+   * its closed form and so never needs it.
+   */
+  inline bool lazy_l2() const {
+    return param_.l2 > 0 && param_.optimizer != kFTRL;
+  }
+
+  /** \brief the factor of k pending l2 steps on a weight with accumulator sg */
+  inline real_t L2Decay(real_t sg, uint32_t k) const {
+    real_t base = 1 - param_.lr * param_.l2 / sqrt(sg);
+    return pow(std::max(base, static_cast<real_t>(0)), k);
+  }
+
+  /**
+   * \brief apply the pending l2 decay of row f of entry e on v
+   * @param buf max_dim elements for a 16-bit state
+   */
+  void DecayRow(int f, const SGDEntry& e, real_t* v, real_t* buf) const;
+
+  /**
+   * \brief copy V into out with the pending l2 decay applied
+   * @param buf see \ref DecayRow, scratch_ is used if nullptr
+   */
+  void CopyV(const SGDEntry& e, real_t* out, real_t* buf = nullptr) const;
+
+  /** \brief update a row of V with dim elements by FTRL-proximal */
+  void UpdateRowFTRL(int dim, real_t const* g, real_t* v, real_t* n, real_t* z);
+
+  /**
+   * \brief the initial V of a feature, which is a pure function of (seed, key)
+   * and so is reproducible regardless of the order of arrival
+   */
+  void InitialV(feaid_t key, real_t* V) const;
+
+  /** \brief allocate V with its initial value, and the state */
+  void InitV(feaid_t key, SGDEntry* e);
+
+  /** \brief allocate V with the given value, and the state */
+  void AllocV(real_t const* V, SGDEntry* e);
+
+  /** \brief copy V, or the initial value if not allocated yet, into out */
+  void ReadV(feaid_t key, const SGDEntry& e, real_t* out) const;
+
+  /** \brief as \ref ReadV, but only the rows in mask, packed into out */
+  void ReadRows(feaid_t key, const SGDEntry& e, real_t const* mask, real_t* out) const;
+
+  /**
+   * \brief whether a feature without an entry is served by a bucket, namely
+   * it is admitted but has not reached the tier
+   */
+  inline bool Tail(feaid_t key) const {
+    if (!buckets_) return false;
+    real_t cnt = admit_sketch_.Query(key);
+    return cnt > param_.V_threshold && cnt < param_.tier_threshold;
+  }
+  /**
+   * \brief whether a feature without an entry was admitted, and has reached
+   * the tier if any, namely its entry was evicted. it starts from the initial
+   * value again
+   */
+  inline bool Evicted(feaid_t key) const {
+    if (admit_sketch_.empty()) return false;
+    real_t cnt = admit_sketch_.Query(key);
+    return cnt > param_.V_threshold && (!buckets_ || cnt >= param_.tier_threshold);
+  }
+  /** \brief the shared bucket of a tail feature */
+  inline int BucketIdx(feaid_t key) const {
+    return SplitMix64(key) % param_.num_buckets;
+  }
+  /** \brief load the buckets saved after kBucketKey */
+  void LoadBuckets(dmlc::Stream* fi, const SGDModelHeader& header);
+  /** \brief load the buckets of a snapshot whose entries are saved with header */
+  void LoadBuckets(const SGDSnapshot& snap, const SGDModelHeader& header);
+
+  /**
+   * \brief load the entry of a key from the snapshot being loaded lazily,
+   * returns nullptr if it is not there or already loaded
+   */
+  SGDEntry* FaultIn(feaid_t key);
+  /** \brief mark the entry of a key in the snapshot being loaded lazily as loaded */
+  void SkipLazy(feaid_t key);
+  /** \brief load the entries not loaded yet in chunks, run by load_thread_ */
+  void LoadRest();
+  /** \brief wait until the snapshot being loaded lazily is loaded */
+  void WaitLoad() const;
+
+  /**
+   * \brief encode the entries of sorted keys into a block, see \ref
+   * SaveCompressed. e[i] is the entry of keys[i], or nullptr if it is in the
+   * cold tier
+   */
+  void EncodeBlock(const SGDModelHeader& header, const feaid_t* keys,
+                   const SGDEntry* const* e, size_t n, std::string* blk) const;
+
+  /**
+   * \brief read the blocks until an empty one, and append the decoded keys in
+   * [begin, end) and their entries. a block out of the range is not
+   * decompressed. returns false if the stream ends
+   */
+  bool LoadBlocks(dmlc::Stream* fi, const SGDModelHeader& header,
+                  feaid_t begin, feaid_t end,
+                  std::vector<feaid_t>* keys, std::vector<SGDEntry>* vals);
 
   /** \brief new w for a server */
   float new_w = 0;
+  /**
+   * \brief the penalty of the model, kept along with new_w. a row with its l2
+   * decay pending is counted as stored
+   */
+  double penalty_ = 0;
+
+  /** \brief the feature counts of features not admitted yet */
+  CountMinSketch admit_sketch_;
+  /**
+   * \brief the buckets shared by the tail features, if tier_threshold > 0.
+   * the servers do not know the fields of features, so they are not per field
+   */
+  std::unique_ptr<SGDEntry[]> buckets_;
+  /** \brief the number of feature count pushes received */
+  int num_cnt_pushes_ = 0;
+
+  /** \brief the memory used by table_ in bytes */
+  size_t mem_bytes_ = 0;
+  /** \brief the number of evicted entries since the last report */
+  size_t num_evicted_ = 0;
+  /** \brief the sum of the staleness of the gradients since the last report */
+  size_t staleness_ = 0;
+  /** \brief the number of gradients summed in staleness_ */
+  size_t num_stale_ = 0;
+  /** \brief the statistics, whose counters are maintained by \ref Account */
+  sgd::ServerStats stats_;
+  /** \brief the most pushed keys, if num_hot_keys > 0 */
+  SpaceSaving hot_keys_;
+  /** \brief the time the statistics were last reported */
+  double last_stats_ = 0;
+  /** \brief the entries evicted from table_, if cold_path is given */
+  ColdStore cold_;
+
+  /** \brief the number of checkpoints taken, see SGDEntry::stamp */
+  uint32_t num_ckpts_ = 0;
+  /**
+   * \brief the chain of the last snapshot saved or loaded, or 0 if none, and
+   * the seq of its last file
+   */
+  uint64_t chain_ = 0;
+  uint32_t seq_ = 0;
+  /** \brief the filename of the full snapshot of chain_ */
+  std::string chain_name_;
+  /** \brief the keys erased since the last checkpoint, if chain_ */
+  std::vector<feaid_t> erased_;
+  /** \brief the keys evicted into cold_ with changes since the last checkpoint */
+  std::unordered_set<feaid_t> dirty_cold_;
+  /**
+   * \brief the snapshot being written, whose i-th entry is written if
+   * cow_done_[i], and the first cow_pos_ entries are all written
+   */
+  SGDSnapshot* cow_snap_ = nullptr;
+  std::vector<bool> cow_done_;
+  size_t cow_pos_ = 0;
+  /** \brief held while writing a snapshot */
+  std::mutex write_mu_;
+  /** \brief the updates since the last checkpoint into log_file_, if open */
+  UpdateLog log_;
+  std::string log_file_;
+  /**
+   * \brief whether the log is being replayed by \ref Recover, whose updates
+   * are not counted as pushes again
+   */
+  bool replaying_ = false;
+
+  /** \brief the periodic checkpoints, see \ref SetCheckpoint */
+  std::string ckpt_file_;
+  bool ckpt_aux_ = false;
+  int ckpt_deltas_ = 0;
+  int ckpt_interval_ = 0;
+  int ckpt_batches_ = 0;
+  /** \brief the number of gradient pushes since the last checkpoint */
+  int num_pushes_ = 0;
+  int num_auto_ckpts_ = 0;
+  double last_ckpt_ = 0;
+  std::unique_ptr<std::thread> ckpt_thread_;
+  std::atomic<bool> ckpt_busy_{false};
+  /**
+   * \brief the snapshot being loaded lazily, the header of its entries, and
+   * whether its i-th entry is loaded, see \ref LoadLazy
+   */
+  std::unique_ptr<SGDSnapshot> lazy_;
+  SGDModelHeader lazy_header_;
+  std::vector<bool> lazy_done_;
+  /** \brief the number of entries loaded on their first access */
+  size_t num_faults_ = 0;
+  std::unique_ptr<std::thread> load_thread_;
+  std::atomic<bool> loading_{false};
+  /** \brief the current time in seconds since start_time_ */
+  uint32_t now_ = 0;
+  double start_time_ = 0;
+  /** \brief the thread runs \ref Evict periodically */
+  std::unique_ptr<std::thread> evict_thread_;
+  std::atomic<bool> done_{false};
+
+  /** \brief parse V_dims into dims_ and set feat_dim */
+  void InitDims();
 
   /** \brief dim of a feature */
   int feat_dim = 0;
+  /** \brief the layout of the field rows of V */
+  FieldDims dims_;
 
-  /** \brief coef for model initialization*/
-  float coef = 1.0;
+  /** \brief the rows being converted from 16 bits, 4 * max_dim, guarded by mu_ */
+  mutable std::vector<real_t> scratch_;
+  /** \brief the state of the stochastic rounding */
+  uint32_t rng_ = 1;
 
-  /** \brief generator for model initialization */
-  std::default_random_engine generator;
-  std::uniform_real_distribution<float> distribution;
 
   SGDUpdaterParam param_;
-  std::unordered_map<feaid_t, SGDEntry> model_;
+  /** \brief the entries, see \ref SGDTableType */
+  std::unique_ptr<SGDTable> table_{SGDTable::Create(kHashTable)};
   mutable std::mutex mu_;
 };
 
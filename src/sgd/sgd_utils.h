@@ -3,9 +3,16 @@
  */
 #ifndef DIFACTO_SGD_SGD_UTILS_H_
 #define DIFACTO_SGD_SGD_UTILS_H_
+#include <stdint.h>
+#include <math.h>
+#include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <sstream>
+#include <utility>
+#include <algorithm>
+#include <functional>
 #include "dmlc/memory_io.h"
 namespace difacto {
 namespace sgd {
@@ -20,6 +27,8 @@ struct Job {
   static const int kValidation = 4;
   static const int kPrediction = 5;
   static const int kEvaluation = 6;
+  static const int kSaveDelta = 7;
+  static const int kLoadCheckpoint = 8;
   /** \brief job type */
   int type;
   /** \brief number of partitions of this file */
@@ -28,6 +37,12 @@ struct Job {
   int part_idx;
   /** \brief the current epoch */
   int epoch;
+  /**
+   * \brief the chain and the seq of a checkpoint saved or loaded, which are
+   * chosen by the scheduler, or 0 if not a checkpoint
+   */
+  uint64_t chain = 0;
+  uint32_t seq = 0;
   Job() { }
   void SerializeToString(std::string* str) const {
     dmlc::Stream* ss = new dmlc::MemoryStringStream(str);
@@ -35,6 +50,8 @@ struct Job {
     ss->Write(num_parts);
     ss->Write(part_idx);
     ss->Write(epoch);
+    ss->Write(chain);
+    ss->Write(seq);
     delete ss;
   }
 
@@ -45,6 +62,8 @@ struct Job {
     ss->Read(&num_parts);
     ss->Read(&part_idx);
     ss->Read(&epoch);
+    ss->Read(&chain);
+    ss->Read(&seq);
     delete ss;
   }
 };
@@ -55,6 +74,13 @@ struct Progress {
   real_t auc = 0;   // auc
   real_t penalty = 0;  //
   real_t nnz_w = 0;  // |w|_0
+  real_t num_evicted = 0;  // entries evicted by the memory budget
+  real_t staleness = 0;  // sum of the staleness of the pushed gradients
+  real_t num_stale = 0;  // the number of gradients summed in staleness
+  real_t grad_raw = 0;  // bytes of the pushed gradients before compression
+  real_t grad_sent = 0;  // bytes of the pushed gradients after compression
+  real_t residual = 0;  // sum of the squared norms of the residuals left by each push
+  real_t num_pushes = 0;  // the number of pushes summed in residual
 
   std::string TextString() {
     std::stringstream ss;
@@ -88,22 +114,147 @@ struct Progress {
   void Reset() {
     loss = 0; penalty = 0;
     auc = 0; nnz_w = 0;
-    nrows = 0;
+    nrows = 0; num_evicted = 0;
+    staleness = 0; num_stale = 0;
+    grad_raw = 0; grad_sent = 0;
+    residual = 0; num_pushes = 0;
   }
 };
 
+/**
+ * \brief the statistics of a server, which are maintained incrementally and
+ * sent to the scheduler after the progress every stats_interval seconds
+ */
+struct ServerStats {
+  /** \brief the number of entries in memory and in the cold tier */
+  uint64_t num_entries = 0;
+  uint64_t num_cold = 0;
+  /** \brief the number of entries and shared buckets with V allocated */
+  uint64_t num_V = 0;
+  /** \brief the memory of the table and the entries, of V, and of the state */
+  uint64_t header_bytes = 0;
+  uint64_t V_bytes = 0;
+  uint64_t state_bytes = 0;
+  /** \brief |w|_0 */
+  real_t nnz_w = 0;
+  /** \brief see SGDTable::LoadFactor */
+  real_t load_factor = 0;
+  /** \brief the number of gradients pushed, and the most pushed keys */
+  real_t num_pushed = 0;
+  std::vector<std::pair<uint64_t, real_t>> hot_keys;
+
+  void SerializeToString(std::string* str) const {
+    dmlc::MemoryStringStream ms(str);
+    dmlc::Stream* ss = &ms;
+    ss->Write(num_entries); ss->Write(num_cold); ss->Write(num_V);
+    ss->Write(header_bytes); ss->Write(V_bytes); ss->Write(state_bytes);
+    ss->Write(nnz_w); ss->Write(load_factor); ss->Write(num_pushed);
+    uint64_t n = hot_keys.size();
+    ss->Write(n);
+    for (const auto& h : hot_keys) { ss->Write(h.first); ss->Write(h.second); }
+  }
+
+  void ParseFromString(const std::string& str) {
+    auto copy = str;
+    dmlc::MemoryStringStream ms(&copy);
+    dmlc::Stream* ss = &ms;
+    ss->Read(&num_entries); ss->Read(&num_cold); ss->Read(&num_V);
+    ss->Read(&header_bytes); ss->Read(&V_bytes); ss->Read(&state_bytes);
+    ss->Read(&nnz_w); ss->Read(&load_factor); ss->Read(&num_pushed);
+    uint64_t n = 0;
+    ss->Read(&n);
+    hot_keys.resize(n);
+    for (auto& h : hot_keys) { ss->Read(&h.first); ss->Read(&h.second); }
+  }
+
+  uint64_t bytes() const { return header_bytes + V_bytes + state_bytes; }
+};
+
 struct Report_prog {
   Progress prog;
   real_t nrows = 0;
   real_t nnz_w = 0;
+  real_t num_evicted = 0;
+  /** \brief the last statistics of each server */
+  std::map<int, ServerStats> servers;
+  bool new_stats = false;
+  std::mutex mu;
+
+  /** \brief merge a report, which is a progress optionally followed by the
+   * statistics of the server */
+  void Merge(int node_id, const std::string& rets) {
+    if (rets.size() <= sizeof(Progress)) {
+      prog.Merge(rets);
+      return;
+    }
+    prog.Merge(rets.substr(0, sizeof(Progress)));
+    std::lock_guard<std::mutex> lk(mu);
+    servers[node_id].ParseFromString(rets.substr(sizeof(Progress)));
+    new_stats = true;
+  }
+
+  /** \brief print the statistics of the servers if updated, otherwise empty */
+  std::string StatsStr() {
+    std::lock_guard<std::mutex> lk(mu);
+    if (!new_stats) return "";
+    new_stats = false;
+    ServerStats sum;
+    uint64_t max_entries = 0;
+    // the hot keys across servers, with the share of the pushes of its server
+    std::vector<std::pair<real_t, uint64_t>> hot;
+    for (const auto& it : servers) {
+      const auto& s = it.second;
+      sum.num_entries += s.num_entries; sum.num_cold += s.num_cold;
+      sum.num_V += s.num_V;
+      sum.header_bytes += s.header_bytes; sum.V_bytes += s.V_bytes;
+      sum.state_bytes += s.state_bytes;
+      max_entries = std::max(max_entries, s.num_entries);
+      for (const auto& h : s.hot_keys) {
+        hot.push_back(std::make_pair(h.second / std::max(s.num_pushed, 1.0f), h.first));
+      }
+    }
+    std::stringstream ss;
+    size_t n = servers.size();
+    ss << "servers: " << sum.num_entries << " entries, " << sum.num_V << " with V, "
+       << sum.num_cold << " cold; " << (sum.bytes() >> 20) << " MB = "
+       << (sum.header_bytes >> 20) << " MB headers + " << (sum.V_bytes >> 20)
+       << " MB V + " << (sum.state_bytes >> 20) << " MB state";
+    if (n > 1 && sum.num_entries) {
+      ss << "; max/mean entries " << static_cast<double>(max_entries) * n / sum.num_entries;
+    }
+    for (const auto& it : servers) {
+      ss << "\n  server " << it.first << ": " << it.second.num_entries << " entries, "
+         << (it.second.bytes() >> 20) << " MB, load factor " << it.second.load_factor;
+    }
+    if (hot.size()) {
+      std::sort(hot.begin(), hot.end(), std::greater<std::pair<real_t, uint64_t>>());
+      ss << "\n  hot keys (share of the pushes of its server):";
+      for (size_t i = 0; i < std::min<size_t>(hot.size(), 10); ++i) {
+        ss << " " << hot[i].second << " (" << hot[i].first * 100 << "%)";
+      }
+    }
+    return ss.str();
+  }
 
   std::string PrintStr() {
     nrows += prog.nrows;
     nnz_w += prog.nnz_w;
+    num_evicted += prog.num_evicted;
 
     char buf[256];
-    snprintf(buf, 256, "%9.4g  %7.2g | %9.4g | %6.4lf  %7.5lf ",
+    int n = snprintf(buf, 256, "%9.4g  %7.2g | %9.4g | %6.4lf  %7.5lf ",
              nrows, prog.nrows, nnz_w, prog.loss / prog.nrows, prog.auc / prog.nrows);
+    if (num_evicted > 0) {
+      n += snprintf(buf + n, 256 - n, "| %9.4g evicted ", num_evicted);
+    }
+    if (prog.num_stale > 0) {
+      n += snprintf(buf + n, 256 - n, "| %6.3g staleness ", prog.staleness / prog.num_stale);
+    }
+    if (prog.grad_sent > 0) {
+      snprintf(buf + n, 256 - n, "| %5.3gx compressed, %6.3g residual",
+               prog.grad_raw / prog.grad_sent,
+               sqrt(prog.residual / std::max<real_t>(prog.num_pushes, 1)));
+    }
     prog.Reset(); 
     return std::string(buf);
   }
@@ -0,0 +1,144 @@
+/**
+ * Copyright (c) 2016 by Contributors
+ * @file   update_log.h
+ * @brief  a log of the updates received by a server since its last snapshot
+ */
+#ifndef DIFACTO_SGD_UPDATE_LOG_H_
+#define DIFACTO_SGD_UPDATE_LOG_H_
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <string>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+namespace difacto {
+
+/**
+ * \brief an append-only file of updates
+ *
+ * a record is (type, #keys, #vals, #lens) followed by the keys, the vals and
+ * the lens. a record is written by a single write, so it survives the process
+ * being killed. the last record of a log may link to the next log, whose name
+ * takes the place of the keys. It is not thread-safe, the caller should hold a
+ * lock.
+ */
+class UpdateLog {
+ public:
+  UpdateLog() { }
+  ~UpdateLog() { Close(); }
+
+  /** \brief the type of a link record */
+  static const int kLink = -1;
+
+  /**
+   * \brief open a log for appending, which is truncated into size bytes, such
+   * as the complete records returned by \ref Replay
+   */
+  void Open(const std::string& filename, size_t size = 0) {
+    Close();
+    filename_ = filename;
+    fd_ = open(filename_.c_str(), O_WRONLY | O_CREAT, 0644);
+    CHECK_GE(fd_, 0) << "failed to open " << filename_;
+    CHECK_EQ(ftruncate(fd_, size), 0) << "failed to truncate " << filename_;
+    CHECK_EQ(lseek(fd_, size, SEEK_SET), static_cast<off_t>(size));
+  }
+  void Close() {
+    if (fd_ < 0) return;
+    close(fd_); fd_ = -1;
+  }
+  bool is_open() const { return fd_ >= 0; }
+  const std::string& filename() const { return filename_; }
+
+  /** \brief append an update, see \ref Updater::Update */
+  void Append(int type, const SArray<feaid_t>& keys, const SArray<real_t>& vals,
+              const SArray<int>& lens) {
+    Write(type, keys.data(), keys.size() * sizeof(feaid_t), vals.size(), lens.size(),
+          vals.data(), lens.data());
+  }
+
+  /** \brief append a link to the next log and close this one */
+  void Link(const std::string& next) {
+    Write(kLink, next.data(), next.size(), 0, 0, nullptr, nullptr);
+    Close();
+  }
+
+  /**
+   * \brief call fn(type, keys, vals, lens) on the updates of a log in order,
+   * and set next to the log it links to, or empty. a truncated record at the
+   * end is ignored. returns the bytes of the complete records
+   */
+  template <typename Fn>
+  static size_t Replay(const std::string& filename, const Fn& fn, std::string* next) {
+    next->clear();
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    CHECK_EQ(fstat(fd, &st), 0);
+    uint64_t size = st.st_size, off = 0;
+    Header h;
+    while (off + sizeof(h) <= size) {
+      CHECK_EQ(pread(fd, &h, sizeof(h), off), (ssize_t)sizeof(h));
+      uint64_t len = sizeof(h) + h.key_bytes + h.num_vals * sizeof(real_t) +
+          h.num_lens * sizeof(int);
+      if (off + len > size) break;
+      uint64_t pos = off + sizeof(h);
+      if (h.type == kLink) {
+        next->resize(h.key_bytes);
+        CHECK_EQ(pread(fd, &(*next)[0], h.key_bytes, pos), (ssize_t)h.key_bytes);
+        off += len;
+        break;
+      }
+      SArray<feaid_t> keys(h.key_bytes / sizeof(feaid_t));
+      SArray<real_t> vals(h.num_vals);
+      SArray<int> lens(h.num_lens);
+      ReadAt(fd, keys.data(), h.key_bytes, &pos);
+      ReadAt(fd, vals.data(), h.num_vals * sizeof(real_t), &pos);
+      ReadAt(fd, lens.data(), h.num_lens * sizeof(int), &pos);
+      fn(h.type, keys, vals, lens);
+      off += len;
+    }
+    close(fd);
+    return off;
+  }
+
+ private:
+  struct Header {
+    int32_t type;
+    int32_t reserved;
+    uint64_t key_bytes;
+    uint64_t num_vals;
+    uint64_t num_lens;
+  };
+
+  void Write(int type, const void* keys, size_t key_bytes, size_t num_vals,
+             size_t num_lens, const real_t* vals, const int* lens) {
+    Header h;
+    h.type = type; h.reserved = 0;
+    h.key_bytes = key_bytes; h.num_vals = num_vals; h.num_lens = num_lens;
+    buf_.resize(sizeof(h) + key_bytes + num_vals * sizeof(real_t) + num_lens * sizeof(int));
+    char* p = &buf_[0];
+    memcpy(p, &h, sizeof(h)); p += sizeof(h);
+    if (key_bytes) memcpy(p, keys, key_bytes);
+    p += key_bytes;
+    if (num_vals) memcpy(p, vals, num_vals * sizeof(real_t));
+    p += num_vals * sizeof(real_t);
+    if (num_lens) memcpy(p, lens, num_lens * sizeof(int));
+    CHECK_EQ(write(fd_, buf_.data(), buf_.size()), (ssize_t)buf_.size())
+        << "failed to write " << filename_;
+  }
+
+  static void ReadAt(int fd, void* buf, size_t len, uint64_t* off) {
+    if (len == 0) return;
+    CHECK_EQ(pread(fd, buf, len, *off), (ssize_t)len) << "failed to read the log";
+    *off += len;
+  }
+
+  std::string filename_;
+  int fd_ = -1;
+  std::string buf_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_SGD_UPDATE_LOG_H_
@@ -8,7 +8,11 @@
 #define DIFACTO_STORE_KVSTORE_DIST_H_
 #include <string>
 #include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
 #include <functional>
+#include <utility>
 #include "ps/ps.h"
 #include "difacto/store.h"
 #include "difacto/updater.h"
@@ -107,6 +111,20 @@ class KVStoreDist : public Store {
            fea_ids, vals, lens, val_type, on_complete);
   }
 
+  int PullRows(const SArray<feaid_t>& fea_ids,
+               int val_type,
+               const SArray<real_t>& masks,
+               SArray<real_t>* vals,
+               SArray<int>* lens,
+               const std::function<void()>& on_complete) override {
+    CHECK(IsKeysOrderd(fea_ids)) << "fea_ids must in non-decreasing order";
+    // a pull carries only the keys, so the masks are pushed ahead of it, and
+    // both carry the id of the masks in their cmd
+    int cmd = kRowMask * (1 + next_mask_id_++ % kNumMaskIds);
+    CHECK_NOTNULL(ps_worker_)->ZPush(fea_ids, masks, {}, cmd);
+    return ps_worker_->ZPull(fea_ids, vals, lens, cmd + val_type, on_complete);
+  }
+
   void Barrier() override {
     ps::Postoffice::Get()->Barrier(ps::kWorkerGroup);
   }
@@ -116,6 +134,11 @@ class KVStoreDist : public Store {
   int NumWorkers() override { return ps::NumWorkers(); }
   int NumServers() override { return ps::NumServers(); }
   int Rank() override { return ps::MyRank(); }
+  std::pair<feaid_t, feaid_t> KeyRange() override {
+    const auto& range = ps::Postoffice::Get()->GetServerKeyRanges()[ps::MyRank()];
+    return std::make_pair(range.begin(), range.end());
+  }
+  bool IsRecovery() override { return ps::Postoffice::Get()->is_recovery(); }
 
 
   /*!
@@ -160,6 +183,16 @@ class KVStoreDist : public Store {
                   const ps::KVPairs<real_t>& req_data,
                   ps::KVServer<real_t>* server) {
     int val_type = req_meta.cmd;
+    if (val_type >= kRowMask) {
+      // keep them for the pull of rows which follows, a resent push just
+      // replaces them
+      {
+        std::lock_guard<std::mutex> lk(mask_mu_);
+        row_masks_[std::make_pair(req_meta.sender, val_type / kRowMask)] = req_data.vals;
+      }
+      server->Response(req_meta);
+      return;
+    }
     updater_->Update(req_data.keys, val_type, req_data.vals, req_data.lens);
     server->Response(req_meta);
     Report();
@@ -170,7 +203,31 @@ class KVStoreDist : public Store {
                   ps::KVServer<real_t>* server) {
     int val_type = req_meta.cmd;
     ps::KVPairs<real_t> response;
-    updater_->Get(req_data.keys, val_type, &(response.vals), &(response.lens));
+    if (val_type >= kRowMask) {
+      SArray<real_t> masks;
+      bool found;
+      {
+        // the masks are dropped once their pull is answered
+        std::lock_guard<std::mutex> lk(mask_mu_);
+        auto it = row_masks_.find(std::make_pair(req_meta.sender, val_type / kRowMask));
+        found = it != row_masks_.end();
+        if (found) {
+          masks = it->second;
+          row_masks_.erase(it);
+        }
+      }
+      val_type %= kRowMask;
+      if (found) {
+        updater_->GetRows(req_data.keys, val_type, masks,
+                          &(response.vals), &(response.lens));
+      } else {
+        // a resent pull, or the masks were lost by a restarted server. all
+        // rows are returned, see SGDLearner::SelectRows
+        updater_->Get(req_data.keys, val_type, &(response.vals), &(response.lens));
+      }
+    } else {
+      updater_->Get(req_data.keys, val_type, &(response.vals), &(response.lens));
+    }
     response.keys = req_data.keys;
     server->Response(req_meta, response);
   }
@@ -182,6 +239,14 @@ class KVStoreDist : public Store {
     return true;
   }
 
+  /**
+   * \brief the cmds of a \ref PullRows. its masks are pushed with the cmd of
+   * kRowMask * (1 + id), and its pull has the cmd of kRowMask * (1 + id) +
+   * val_type, where id is in [0, kNumMaskIds) and val_type < kRowMask
+   */
+  static const int kRowMask = 100;
+  static const int kNumMaskIds = 1 << 16;
+
   KVStoreParam kvparam;
 
   /**
@@ -208,6 +273,16 @@ class KVStoreDist : public Store {
 
   ThreadsafeQueue<MsgBuf> msg_push_buf_;
   ThreadsafeQueue<MsgBuf> msg_pull_buf_;
+
+  /**
+   * \brief the row masks waiting for their pulls, by (sender, 1 + id). the
+   * ones whose pull was answered before them, such as after a resend, are
+   * replaced once their id is used again
+   */
+  std::map<std::pair<int, int>, SArray<real_t>> row_masks_;
+  std::mutex mask_mu_;
+  /** \brief the id of the next masks pushed by this worker */
+  std::atomic<unsigned> next_mask_id_{0};
 };
 
 }  // namespace difacto
@@ -44,6 +44,17 @@ class StoreLocal : public Store {
     return time_++;
   }
 
+  int PullRows(const SArray<feaid_t>& fea_ids,
+               int val_type,
+               const SArray<real_t>& masks,
+               SArray<real_t>* vals,
+               SArray<int>* lens,
+               const std::function<void()>& on_complete) override {
+    updater_->GetRows(fea_ids, val_type, masks, vals, lens);
+    if (on_complete) on_complete();
+    return time_++;
+  }
+
   void Wait(int time) override { }
   int Rank() override { return 0; }
   int NumWorkers() override { return 1; }
@@ -62,12 +62,13 @@ class DistTracker : public Tracker {
     app_->Wait(ts);
   }
 
-  void StartDispatch(int num_parts, int job_type, int epoch) {
+  void StartDispatch(int num_parts, int job_type, int epoch,
+                     const std::vector<int>& skip) {
     job_type_ = job_type;
     epoch_ = epoch;
     nparts_ = num_parts;
     pool_.Clear();
-    pool_.Add(num_parts);
+    pool_.Add(num_parts, skip);
     // send an empty job to wake up workers
     Send(kSendWorkload, "", NodeID::kWorkerGroup);
   }
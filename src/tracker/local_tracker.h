@@ -38,16 +38,20 @@ class LocalTracker : public Tracker {
     tracker_->Wait(0);
   };
 
-  void StartDispatch(int num_parts, int job_type, int epoch) {
-    std::vector<std::pair<int, std::string>> jobs(num_parts);
+  void StartDispatch(int num_parts, int job_type, int epoch,
+                     const std::vector<int>& skip) {
+    std::vector<bool> skipped(num_parts);
+    for (int i : skip) skipped[i] = true;
+    std::vector<std::pair<int, std::string>> jobs;
     for (int i = 0; i < num_parts; ++i) {
-      jobs[i].first = NodeID::kWorkerGroup;
+      if (skipped[i]) continue;
+      jobs.push_back(std::make_pair(NodeID::kWorkerGroup, std::string()));
       sgd::Job job;
       job.type = job_type;
       job.epoch = epoch;
       job.num_parts = num_parts;
       job.part_idx = i;
-      job.SerializeToString(&jobs[i].second);
+      job.SerializeToString(&jobs.back().second);
     }
     Issue(jobs);
   };